@@ -0,0 +1,1027 @@
+// Floyd-Steinberg dithering on packed RGB8 data (3 bytes per pixel,
+// no padding between rows).
+//
+// The classic Floyd-Steinberg loop walks the image one pixel at a
+// time and pushes error into four neighbours. That's inherently
+// serial along a row (every pixel needs the 7/16 error from its left
+// neighbour), but the error that goes down into the next row
+// isn't. As long as we apply it in the same order the serial loop
+// would, with the same saturating adds, we get exactly the same
+// output. So each row is split into two passes:
+//
+// 1. `quantize_span`: walk the row left to right, quantizing each
+//    channel to 2 bits and carrying 7/16 of the error to the right. The
+//    full error for every channel gets saved in an error row.
+//
+// 2. `diffuse_down`: add 1/16, 5/16, and 3/16 of the saved errors
+//    (from the pixels up-left, up, and up-right respectively, which is
+//    the order the serial loop reaches them) into the next row. Every
+//    byte in the row is independent here, so this is the part that
+//    gets vectorized.
+//
+// The quantization error is always in -63..=63, which means every
+// intermediate value fits comfortably in an i16.
+//
+// Splitting things up like this also means rows can be dithered in
+// parallel, as long as each row stays a little behind the one above
+// it: a pixel needs the errors of the three pixels above it, and the
+// pixel to its left. That's the wavefront mode (see
+// `dither_wavefront`), which gives the same output as the serial one.
+//
+// It also means a frame can be re-dithered starting at any row, given
+// the errors the row above passed down. `DamageDitherer` keeps those
+// for every row, so when only part of a mostly still image changes
+// (like a mirrored desktop), it starts at the first changed row, and
+// stops as soon as a row below the changes passes down the same errors
+// it did last time, since everything under that comes out the same.
+
+use std::ops::Range;
+use std::slice;
+use std::sync::{Arc, Condvar, Mutex};
+use std::sync::atomic::{AtomicI8, AtomicUsize, Ordering};
+use std::thread::{self, JoinHandle};
+
+use crate::format::{rgb8_to_6bpp, two_pixels_to_msb_lsb};
+
+/// Extra error entries on either side of an error row, so that the
+/// pixels at the edges can read a (zero) neighbour error without
+/// bounds checks. This is one pixel's worth of channels.
+const ERROR_PAD: usize = 3;
+
+/// In wavefront mode, rows are handled this many pixels at a time. A
+/// row can start on a chunk once the row above it has finished that
+/// chunk plus one pixel, so this is roughly how far behind each row
+/// runs.
+const WAVEFRONT_CHUNK: usize = 16;
+
+/// Signature shared by all the implementations of `diffuse_down`.
+type DiffuseDownFn = fn(&mut [u8], &[i8]);
+
+/// Floyd-Steinberg ditherer for images of a fixed width. This keeps
+/// the two rows of working state that the dither needs between frames,
+/// so dithering a frame doesn't allocate anything, and never needs a
+/// full-frame copy of the input.
+///
+/// With more than one thread, rows are dithered in parallel as a
+/// wavefront instead, by worker threads that stay around between
+/// frames.
+pub struct Ditherer {
+    width: usize,
+    /// the row being quantized, as packed RGB8 with error already
+    /// diffused into it
+    row: Vec<u8>,
+    /// the row below it
+    next_row: Vec<u8>,
+    /// quantization error of every channel in `row`, with `ERROR_PAD`
+    /// zeros on either side
+    errors: Vec<i8>,
+    diffuse_down: DiffuseDownFn,
+
+    /// number of threads to dither with, 1 for the serial dither
+    threads: usize,
+    /// wavefront mode: the workers, started on the first frame
+    pool: Option<WavefrontPool>,
+    /// wavefront mode: the per-row state, sized for the last frame
+    wavefront_rows: Arc<WavefrontRows>,
+}
+
+impl Ditherer {
+    /// Make a ditherer for images `width` pixels wide, which uses
+    /// `threads` threads per image.
+    pub fn new(width: usize, threads: usize) -> Ditherer {
+        Ditherer {
+            width,
+            row: vec![0u8; width * 3],
+            next_row: vec![0u8; width * 3],
+            errors: vec![0i8; width * 3 + 2 * ERROR_PAD],
+            diffuse_down: diffuse_down_impl(),
+            threads: threads.max(1),
+            pool: None,
+            wavefront_rows: Arc::new(WavefrontRows { progress: Vec::new(), errors: Vec::new() }),
+        }
+    }
+
+    /// Dither `src` straight into 6bpp (0bBBGGRR) pixels in `out`, one
+    /// byte per pixel. Pixels in `src` are `src_bpp` bytes each, in
+    /// RGB order, and anything after the blue byte (like the alpha
+    /// channel of RGBA) is ignored. `src` isn't modified, so this can
+    /// read directly from a mapped GStreamer buffer.
+    // the host's encoder goes straight to formatted rows, but the
+    // formatter and the benchmarks still want plain pixels
+    pub fn dither_to_6bpp(&mut self, src: &[u8], src_bpp: usize, out: &mut [u8]) {
+        self.dither(src, src_bpp, out, Packing::Pixels6bpp);
+    }
+
+    /// Dither `src` (in the same layout as `dither_to_6bpp` takes)
+    /// straight into a formatted Sharpie frame: every row is the MSbs
+    /// of its pixels in `width / 2` bytes, then the LSbs in another
+    /// `width / 2`. This is the same thing as dithering and then
+    /// formatting, without the extra pass over a dithered image.
+    pub fn dither_to_sharpie(&mut self, src: &[u8], src_bpp: usize, out: &mut [u8]) {
+        assert!(self.width % 2 == 0, "Sharpie rows pack two pixels per byte");
+        self.dither(src, src_bpp, out, Packing::Sharpie);
+    }
+
+    fn dither(&mut self, src: &[u8], src_bpp: usize, out: &mut [u8], packing: Packing) {
+        assert!(src_bpp >= 3, "source pixels need at least 3 bytes");
+        let src_stride = self.width * src_bpp;
+        assert!(src.len() % src_stride == 0,
+                "source length must be a whole number of {}-pixel rows", self.width);
+        let height = src.len() / src_stride;
+        // both packings come out to one byte per pixel
+        assert_eq!(out.len(), self.width * height, "output must be one byte per pixel");
+
+        if height == 0 {
+            return;
+        }
+        if self.threads > 1 && height > 1 {
+            self.dither_wavefront(src, src_bpp, out, height, packing);
+            return;
+        }
+
+        let stride = self.width * 3;
+        load_row(&mut self.row, &src[..src_stride], src_bpp);
+
+        for (y, out_row) in out.chunks_exact_mut(self.width).enumerate() {
+            quantize_span(&mut self.row, &mut self.errors[ERROR_PAD..ERROR_PAD + stride],
+                          &mut [0; 3]);
+            packing.pack(out_row, 0, &self.row);
+
+            if y + 1 < height {
+                load_row(&mut self.next_row,
+                         &src[(y + 1) * src_stride..(y + 2) * src_stride], src_bpp);
+                (self.diffuse_down)(&mut self.next_row, &self.errors);
+                std::mem::swap(&mut self.row, &mut self.next_row);
+            }
+        }
+    }
+
+    /// Same as the serial dither, but with every thread taking every
+    /// `threads`th row. Each row works through its pixels a chunk at a
+    /// time, waiting until the row above has got far enough ahead.
+    fn dither_wavefront(&mut self, src: &[u8], src_bpp: usize, out: &mut [u8], height: usize,
+                        packing: Packing) {
+        let width = self.width;
+        let errors_stride = width * 3 + 2 * ERROR_PAD;
+
+        if self.wavefront_rows.progress.len() != height {
+            self.wavefront_rows = Arc::new(WavefrontRows {
+                progress: (0..height).map(|_| AtomicUsize::new(0)).collect(),
+                // the padding never gets written, so it stays zero
+                errors: (0..height * errors_stride).map(|_| AtomicI8::new(0)).collect(),
+            });
+        }
+        for progress in &self.wavefront_rows.progress {
+            progress.store(0, Ordering::Relaxed);
+        }
+
+        let (threads, diffuse_down) = (self.threads, self.diffuse_down);
+        let pool = self.pool.get_or_insert_with(|| WavefrontPool::new(width, threads, diffuse_down));
+        let finished = pool.run(WavefrontFrame {
+            src: src.as_ptr(),
+            src_len: src.len(),
+            src_bpp,
+            out: out.as_mut_ptr(),
+            height,
+            packing,
+            rows: self.wavefront_rows.clone(),
+        });
+        if !finished {
+            // the worker that panicked is gone, so start over with new
+            // ones next time
+            self.pool = None;
+            panic!("a wavefront dither worker panicked");
+        }
+    }
+}
+
+/// Per-row state for wavefront mode, for one image height.
+struct WavefrontRows {
+    /// how many pixels of each row are done
+    progress: Vec<AtomicUsize>,
+    /// the error rows of the whole image, padded like
+    /// `Ditherer::errors`. these are atomics because a row's errors get
+    /// read by the thread doing the row below while they're still
+    /// being written.
+    errors: Vec<AtomicI8>,
+}
+
+/// A frame for the wavefront workers to dither. `src` and `out` come
+/// from the slices `Ditherer::dither_wavefront` was given.
+#[derive(Clone)]
+struct WavefrontFrame {
+    src: *const u8,
+    src_len: usize,
+    src_bpp: usize,
+    out: *mut u8,
+    height: usize,
+    packing: Packing,
+    rows: Arc<WavefrontRows>,
+}
+
+// the pointers only get used between WavefrontPool::run() handing the
+// frame out and every worker saying it's done, while the slices they
+// came from are still borrowed, and every worker writes its own rows of
+// `out`
+unsafe impl Send for WavefrontFrame {}
+
+struct WavefrontState {
+    /// the frame being dithered, if there is one
+    frame: Option<WavefrontFrame>,
+    /// counts frames, so a worker can tell a new one from the one it
+    /// just did
+    generation: u64,
+    /// workers still on the current frame
+    running: usize,
+    /// whether a worker panicked on the current frame
+    panicked: bool,
+    stop: bool,
+}
+
+/// What the wavefront workers share with their `Ditherer`.
+struct WavefrontShared {
+    state: Mutex<WavefrontState>,
+    /// signalled when there's a new frame, or it's time to stop
+    start: Condvar,
+    /// signalled every time a worker finishes a frame
+    done: Condvar,
+}
+
+/// The worker threads for wavefront mode. Spawning them (and
+/// allocating their rows) for every frame costs a good chunk of the
+/// time the dither itself takes, so they wait for the next frame
+/// instead.
+struct WavefrontPool {
+    shared: Arc<WavefrontShared>,
+    workers: Vec<JoinHandle<()>>,
+}
+
+impl WavefrontPool {
+    fn new(width: usize, threads: usize, diffuse_down: DiffuseDownFn) -> WavefrontPool {
+        let shared = Arc::new(WavefrontShared {
+            state: Mutex::new(WavefrontState {
+                frame: None,
+                generation: 0,
+                running: 0,
+                panicked: false,
+                stop: false,
+            }),
+            start: Condvar::new(),
+            done: Condvar::new(),
+        });
+        let workers = (0..threads).map(|index| {
+            let shared = shared.clone();
+            thread::spawn(move || wavefront_worker(&shared, index, threads, width, diffuse_down))
+        }).collect();
+        WavefrontPool { shared, workers }
+    }
+
+    /// Dither `frame` with every worker, and wait for them to finish.
+    /// Returns false if one of them panicked.
+    fn run(&self, frame: WavefrontFrame) -> bool {
+        let mut state = self.shared.state.lock().unwrap();
+        state.frame = Some(frame);
+        state.generation += 1;
+        state.running = self.workers.len();
+        state.panicked = false;
+        self.shared.start.notify_all();
+        while state.running > 0 {
+            state = self.shared.done.wait(state).unwrap();
+        }
+        // nothing reads the frame's pointers after this
+        state.frame = None;
+        !state.panicked
+    }
+}
+
+impl Drop for WavefrontPool {
+    fn drop(&mut self) {
+        self.shared.state.lock().unwrap().stop = true;
+        self.shared.start.notify_all();
+        for worker in self.workers.drain(..) {
+            let _ = worker.join();
+        }
+    }
+}
+
+/// Tells `WavefrontPool::run` that a worker is done with the frame when
+/// it's dropped, panic or not.
+struct WorkerFinished<'a> {
+    shared: &'a WavefrontShared,
+    rows: &'a WavefrontRows,
+}
+
+impl Drop for WorkerFinished<'_> {
+    fn drop(&mut self) {
+        let panicked = thread::panicking();
+        if panicked {
+            // don't leave the other workers waiting on rows this one
+            // will never finish
+            for progress in &self.rows.progress {
+                progress.store(usize::MAX, Ordering::Release);
+            }
+        }
+        let mut state = self.shared.state.lock().unwrap();
+        state.running -= 1;
+        state.panicked |= panicked;
+        self.shared.done.notify_all();
+    }
+}
+
+/// A wavefront worker: dithers rows `index`, `index + threads`, and so
+/// on of every frame it's handed, until the pool stops.
+fn wavefront_worker(shared: &WavefrontShared, index: usize, threads: usize, width: usize,
+                    diffuse_down: DiffuseDownFn) {
+    let stride = width * 3;
+    let errors_stride = stride + 2 * ERROR_PAD;
+    let mut row = vec![0u8; stride];
+    let mut above = [0i8; WAVEFRONT_CHUNK * 3 + 2 * ERROR_PAD];
+    let mut chunk_errors = [0i8; WAVEFRONT_CHUNK * 3];
+    let mut generation = 0;
+
+    loop {
+        let frame = {
+            let mut state = shared.state.lock().unwrap();
+            while state.generation == generation && !state.stop {
+                state = shared.start.wait(state).unwrap();
+            }
+            if state.stop {
+                return;
+            }
+            generation = state.generation;
+            state.frame.clone().unwrap()
+        };
+        let _finished = WorkerFinished { shared, rows: &frame.rows };
+        let progress = &frame.rows.progress;
+        let errors = &frame.rows.errors;
+        // safe because of what's said at WavefrontFrame
+        let src = unsafe { slice::from_raw_parts(frame.src, frame.src_len) };
+        let src_stride = width * frame.src_bpp;
+
+        for y in (index..frame.height).step_by(threads) {
+            let out_row = unsafe { slice::from_raw_parts_mut(frame.out.add(y * width), width) };
+            load_row(&mut row, &src[y * src_stride..(y + 1) * src_stride], frame.src_bpp);
+            let mut carry = [0i16; 3];
+            let mut x0 = 0;
+            while x0 < width {
+                let x1 = (x0 + WAVEFRONT_CHUNK).min(width);
+                let span = &mut row[x0 * 3..x1 * 3];
+
+                if y > 0 {
+                    // we need the errors of the pixels above this
+                    // chunk, plus one on either side
+                    wait_for_progress(&progress[y - 1], (x1 + 1).min(width));
+                    // with the padding, the error of the pixel up and
+                    // to the left of x0 starts at x0 * 3
+                    let above = &mut above[..span.len() + 2 * ERROR_PAD];
+                    let first = (y - 1) * errors_stride + x0 * 3;
+                    for (e, shared) in above.iter_mut().zip(&errors[first..]) {
+                        *e = shared.load(Ordering::Relaxed);
+                    }
+                    diffuse_down(span, above);
+                }
+
+                let chunk_errors = &mut chunk_errors[..span.len()];
+                quantize_span(span, chunk_errors, &mut carry);
+                let first = y * errors_stride + ERROR_PAD + x0 * 3;
+                for (e, shared) in chunk_errors.iter().zip(&errors[first..]) {
+                    shared.store(*e, Ordering::Relaxed);
+                }
+                frame.packing.pack(out_row, x0, span);
+
+                // publishes the errors stored above to the thread
+                // doing the next row
+                progress[y].store(x1, Ordering::Release);
+                x0 = x1;
+            }
+        }
+    }
+}
+
+/// A serial Sharpie ditherer for frames that mostly don't change. It
+/// remembers the last source frame, the formatted frame it made from
+/// it, and the errors every row passed down, and only re-dithers the
+/// rows that can have changed. The output is exactly what
+/// `Ditherer::dither_to_sharpie` would make.
+pub struct DamageDitherer {
+    width: usize,
+    row: Vec<u8>,
+    /// errors of `row`, padded
+    errors: Vec<i8>,
+    /// the errors of every row of the last frame, padded like
+    /// `Ditherer::errors`
+    row_errors: Vec<i8>,
+    /// the last frame's source pixels
+    last_src: Vec<u8>,
+    /// and what it dithered to
+    frame: Vec<u8>,
+    diffuse_down: DiffuseDownFn,
+}
+
+impl DamageDitherer {
+    pub fn new(width: usize) -> DamageDitherer {
+        assert!(width % 2 == 0, "Sharpie rows pack two pixels per byte");
+        DamageDitherer {
+            width,
+            row: vec![0u8; width * 3],
+            errors: vec![0i8; width * 3 + 2 * ERROR_PAD],
+            row_errors: Vec::new(),
+            last_src: Vec::new(),
+            frame: Vec::new(),
+            diffuse_down: diffuse_down_impl(),
+        }
+    }
+
+    /// Dither `src` (laid out like `Ditherer::dither_to_sharpie` takes
+    /// it) into a formatted frame in `out`. Returns the rows that were
+    /// re-dithered, which are the only ones that can be different from
+    /// last time, or None if `src` didn't change at all (and then
+    /// `out` isn't touched).
+    pub fn dither_to_sharpie(&mut self, src: &[u8], src_bpp: usize,
+                             out: &mut [u8]) -> Option<Range<usize>> {
+        assert!(src_bpp >= 3, "source pixels need at least 3 bytes");
+        let src_stride = self.width * src_bpp;
+        assert!(src.len() % src_stride == 0,
+                "source length must be a whole number of {}-pixel rows", self.width);
+        let height = src.len() / src_stride;
+        assert_eq!(out.len(), self.width * height, "output must be one byte per pixel");
+
+        let damage = if self.last_src.len() != src.len() {
+            // first frame (or a new size), so everything's new
+            self.last_src = src.to_vec();
+            self.frame = vec![0u8; out.len()];
+            self.row_errors = vec![0i8; height * self.errors_stride()];
+            0..height
+        } else {
+            let row_changed = |y: usize| {
+                let rows = y * src_stride..(y + 1) * src_stride;
+                src[rows.clone()] != self.last_src[rows]
+            };
+            let first = (0..height).find(|&y| row_changed(y))?;
+            let last = (first..height).rev().find(|&y| row_changed(y)).unwrap();
+            let changed = first * src_stride..(last + 1) * src_stride;
+            self.last_src[changed.clone()].copy_from_slice(&src[changed]);
+            first..last + 1
+        };
+
+        let end = self.redither(src, src_bpp, damage.clone(), height);
+        out.copy_from_slice(&self.frame);
+        Some(damage.start..end)
+    }
+
+    fn errors_stride(&self) -> usize {
+        self.width * 3 + 2 * ERROR_PAD
+    }
+
+    /// Dither from the first row of `damage` down, until a row after
+    /// the damage passes down the same errors it did last time. Returns
+    /// the row after the last one that got dithered.
+    fn redither(&mut self, src: &[u8], src_bpp: usize, damage: Range<usize>,
+                height: usize) -> usize {
+        let width = self.width;
+        let stride = width * 3;
+        let errors_stride = self.errors_stride();
+        let src_stride = width * src_bpp;
+        for y in damage.start..height {
+            load_row(&mut self.row, &src[y * src_stride..(y + 1) * src_stride], src_bpp);
+            if y > 0 {
+                let above = &self.row_errors[(y - 1) * errors_stride..y * errors_stride];
+                (self.diffuse_down)(&mut self.row, above);
+            }
+            quantize_span(&mut self.row, &mut self.errors[ERROR_PAD..ERROR_PAD + stride],
+                          &mut [0; 3]);
+            Packing::Sharpie.pack(&mut self.frame[y * width..(y + 1) * width], 0, &self.row);
+
+            // on the first frame, the damage is every row, so this
+            // never stops early
+            let saved = &mut self.row_errors[y * errors_stride..(y + 1) * errors_stride];
+            let converged = y >= damage.end && *saved == self.errors;
+            saved.copy_from_slice(&self.errors);
+            if converged {
+                return y + 1;
+            }
+        }
+        height
+    }
+}
+
+/// Wait until `progress` reaches at least `needed`. The row above is
+/// only ever a chunk or so away from where we need it, so this spins
+/// for a bit before giving up the CPU.
+#[inline]
+fn wait_for_progress(progress: &AtomicUsize, needed: usize) {
+    let mut spins = 0;
+    while progress.load(Ordering::Acquire) < needed {
+        if spins < 64 {
+            std::hint::spin_loop();
+            spins += 1;
+        } else {
+            thread::yield_now();
+        }
+    }
+}
+
+/// What the ditherer writes out for every quantized row.
+#[derive(Copy, Clone)]
+enum Packing {
+    /// one 0bBBGGRR byte per pixel
+    Pixels6bpp,
+    /// a row of Sharpie's MSb and LSb bytes
+    Sharpie,
+}
+
+impl Packing {
+    /// Pack a span of quantized RGB8 pixels starting at pixel `x0`
+    /// into `out_row`. For `Sharpie`, `x0` has to be even.
+    #[inline]
+    fn pack(self, out_row: &mut [u8], x0: usize, rgb: &[u8]) {
+        match self {
+            Packing::Pixels6bpp => {
+                for (px, rgb) in out_row[x0..].iter_mut().zip(rgb.chunks_exact(3)) {
+                    *px = rgb8_to_6bpp(rgb);
+                }
+            },
+            Packing::Sharpie => {
+                let (msbs, lsbs) = out_row.split_at_mut(out_row.len() / 2);
+                let pairs = rgb.chunks_exact(6);
+                for ((msb, lsb), pair) in msbs[x0 / 2..].iter_mut()
+                    .zip(lsbs[x0 / 2..].iter_mut())
+                    .zip(pairs) {
+                    (*msb, *lsb) = two_pixels_to_msb_lsb(rgb8_to_6bpp(&pair[..3]),
+                                                         rgb8_to_6bpp(&pair[3..]));
+                }
+            },
+        }
+    }
+}
+
+/// Copy a row of `src_bpp`-byte pixels into a packed RGB8 row.
+#[inline]
+fn load_row(row: &mut [u8], src: &[u8], src_bpp: usize) {
+    if src_bpp == 3 {
+        row.copy_from_slice(src);
+        return;
+    }
+    for (dst, src) in row.chunks_exact_mut(3).zip(src.chunks_exact(src_bpp)) {
+        dst.copy_from_slice(&src[..3]);
+    }
+}
+
+/// Quantize a span of a row to 2 bits per channel (scaled back up to
+/// full range), carrying 7/16 of each pixel's error into the pixel to
+/// its right. The error of every channel gets written to `errors`,
+/// which must be the same length as `span`. `carry` is the error
+/// carried into the first pixel, and comes back out as the error to
+/// carry into the pixel after the span.
+#[inline]
+fn quantize_span(span: &mut [u8], errors: &mut [i8], carry: &mut [i16; 3]) {
+    debug_assert_eq!(span.len(), errors.len());
+
+    for (px, err) in span.chunks_exact_mut(3).zip(errors.chunks_exact_mut(3)) {
+        for c in 0..3 {
+            // this is the critical path of the whole dither, so the
+            // quantize/error/carry math comes out of a table instead
+            let value = saturate(px[c] as i16 + carry[c]) as usize;
+            let entry = QUANTIZE_TABLE[value];
+            px[c] = entry.quantized;
+            err[c] = entry.error;
+            carry[c] = entry.carry as i16;
+        }
+    }
+}
+
+/// Everything `quantize_span` needs to know about a channel value.
+#[derive(Copy, Clone)]
+struct QuantizeEntry {
+    /// the value quantized to 2 bits and scaled back to 0, 85, 170, or 255
+    quantized: u8,
+    /// the value minus `quantized`
+    error: i8,
+    /// 7/16 of `error`, for the pixel to the right
+    carry: i8,
+}
+
+const QUANTIZE_TABLE: [QuantizeEntry; 256] = build_quantize_table();
+
+const fn build_quantize_table() -> [QuantizeEntry; 256] {
+    let mut table = [QuantizeEntry { quantized: 0, error: 0, carry: 0 }; 256];
+    let mut value = 0;
+    while value < 256 {
+        let quantized = (value as i16 >> 6) * 85;
+        let error = value as i16 - quantized;
+        table[value] = QuantizeEntry {
+            quantized: quantized as u8,
+            error: error as i8,
+            carry: scale_error(error, 7) as i8,
+        };
+        value += 1;
+    }
+    table
+}
+
+/// Diffuse a row of saved errors into the row below it. `errors` has
+/// `ERROR_PAD` zeros on either side of the row's actual errors.
+fn diffuse_down_scalar(next_row: &mut [u8], errors: &[i8]) {
+    diffuse_down_scalar_from(next_row, errors, 0);
+}
+
+/// Scalar version of `diffuse_down`, starting partway through a
+/// row. The SIMD versions use this for whatever's left over after
+/// their last full vector.
+#[inline]
+fn diffuse_down_scalar_from(next_row: &mut [u8], errors: &[i8], start: usize) {
+    debug_assert_eq!(next_row.len() + 2 * ERROR_PAD, errors.len());
+
+    for i in start..next_row.len() {
+        // errors[i] is the pixel up and to the left (it's offset by
+        // the padding), errors[i + 3] is directly above, and
+        // errors[i + 6] is up and to the right
+        let mut value = next_row[i] as i16;
+        value = saturate(value + scale_error(errors[i] as i16, 1));
+        value = saturate(value + scale_error(errors[i + 3] as i16, 5));
+        value = saturate(value + scale_error(errors[i + 6] as i16, 3));
+        next_row[i] = value as u8;
+    }
+}
+
+/// Scale an error by `weight`/16, rounding toward zero like the
+/// original `difference * quant_num / 16`.
+#[inline(always)]
+const fn scale_error(error: i16, weight: i16) -> i16 {
+    error * weight / 16
+}
+
+/// Clamp to the range of a u8, which is what `saturating_add_signed`
+/// did in the original per-pixel code.
+#[inline(always)]
+fn saturate(value: i16) -> i16 {
+    value.clamp(0, 255)
+}
+
+/// Pick the fastest `diffuse_down` this CPU supports.
+fn diffuse_down_impl() -> DiffuseDownFn {
+    #[cfg(target_arch = "x86_64")]
+    {
+        if is_x86_feature_detected!("avx2") {
+            return x86::diffuse_down_avx2_safe;
+        }
+        if is_x86_feature_detected!("sse4.1") {
+            return x86::diffuse_down_sse41_safe;
+        }
+    }
+
+    diffuse_down_scalar
+}
+
+#[cfg(target_arch = "x86_64")]
+mod x86 {
+    use std::arch::x86_64::*;
+    use super::diffuse_down_scalar_from;
+
+    // these wrappers are only ever handed out by diffuse_down_impl()
+    // after it has checked that the CPU has the features they need
+    pub(super) fn diffuse_down_avx2_safe(next_row: &mut [u8], errors: &[i8]) {
+        unsafe { diffuse_down_avx2(next_row, errors) }
+    }
+
+    pub(super) fn diffuse_down_sse41_safe(next_row: &mut [u8], errors: &[i8]) {
+        unsafe { diffuse_down_sse41(next_row, errors) }
+    }
+
+    /// Divide every lane by 16, rounding toward zero. An arithmetic
+    /// shift rounds toward negative infinity, so negative lanes get
+    /// 15 added first.
+    #[target_feature(enable = "avx2")]
+    unsafe fn div16_avx2(v: __m256i) -> __m256i {
+        let bias = _mm256_and_si256(_mm256_srai_epi16(v, 15), _mm256_set1_epi16(15));
+        _mm256_srai_epi16(_mm256_add_epi16(v, bias), 4)
+    }
+
+    #[target_feature(enable = "avx2")]
+    unsafe fn diffuse_down_avx2(next_row: &mut [u8], errors: &[i8]) {
+        debug_assert_eq!(next_row.len() + 2 * super::ERROR_PAD, errors.len());
+
+        let zero = _mm256_setzero_si256();
+        let max = _mm256_set1_epi16(255);
+        let w1 = _mm256_set1_epi16(1);
+        let w5 = _mm256_set1_epi16(5);
+        let w3 = _mm256_set1_epi16(3);
+
+        let len = next_row.len();
+        let row = next_row.as_mut_ptr();
+        let err = errors.as_ptr();
+        let mut i = 0;
+        // 16 bytes at a time, widened to 16 i16 lanes
+        while i + 16 <= len {
+            unsafe {
+                let mut value = _mm256_cvtepu8_epi16(_mm_loadu_si128(row.add(i) as *const __m128i));
+                let up_left = _mm256_cvtepi8_epi16(_mm_loadu_si128(err.add(i) as *const __m128i));
+                let up = _mm256_cvtepi8_epi16(_mm_loadu_si128(err.add(i + 3) as *const __m128i));
+                let up_right = _mm256_cvtepi8_epi16(_mm_loadu_si128(err.add(i + 6) as *const __m128i));
+
+                // each step saturates before the next, exactly like
+                // the three separate saturating adds in the scalar code
+                value = _mm256_add_epi16(value, div16_avx2(_mm256_mullo_epi16(up_left, w1)));
+                value = _mm256_min_epi16(_mm256_max_epi16(value, zero), max);
+                value = _mm256_add_epi16(value, div16_avx2(_mm256_mullo_epi16(up, w5)));
+                value = _mm256_min_epi16(_mm256_max_epi16(value, zero), max);
+                value = _mm256_add_epi16(value, div16_avx2(_mm256_mullo_epi16(up_right, w3)));
+                value = _mm256_min_epi16(_mm256_max_epi16(value, zero), max);
+
+                // packus works per 128-bit lane, so pack the two
+                // halves against each other to keep the bytes in order
+                let packed = _mm_packus_epi16(_mm256_castsi256_si128(value),
+                                              _mm256_extracti128_si256(value, 1));
+                _mm_storeu_si128(row.add(i) as *mut __m128i, packed);
+            }
+            i += 16;
+        }
+
+        diffuse_down_scalar_from(next_row, errors, i);
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    unsafe fn div16_sse41(v: __m128i) -> __m128i {
+        let bias = _mm_and_si128(_mm_srai_epi16(v, 15), _mm_set1_epi16(15));
+        _mm_srai_epi16(_mm_add_epi16(v, bias), 4)
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    unsafe fn diffuse_down_sse41(next_row: &mut [u8], errors: &[i8]) {
+        debug_assert_eq!(next_row.len() + 2 * super::ERROR_PAD, errors.len());
+
+        let zero = _mm_setzero_si128();
+        let max = _mm_set1_epi16(255);
+        let w1 = _mm_set1_epi16(1);
+        let w5 = _mm_set1_epi16(5);
+        let w3 = _mm_set1_epi16(3);
+
+        let len = next_row.len();
+        let row = next_row.as_mut_ptr();
+        let err = errors.as_ptr();
+        let mut i = 0;
+        // 8 bytes at a time, widened to 8 i16 lanes
+        while i + 8 <= len {
+            unsafe {
+                let mut value = _mm_cvtepu8_epi16(_mm_loadl_epi64(row.add(i) as *const __m128i));
+                let up_left = _mm_cvtepi8_epi16(_mm_loadl_epi64(err.add(i) as *const __m128i));
+                let up = _mm_cvtepi8_epi16(_mm_loadl_epi64(err.add(i + 3) as *const __m128i));
+                let up_right = _mm_cvtepi8_epi16(_mm_loadl_epi64(err.add(i + 6) as *const __m128i));
+
+                value = _mm_add_epi16(value, div16_sse41(_mm_mullo_epi16(up_left, w1)));
+                value = _mm_min_epi16(_mm_max_epi16(value, zero), max);
+                value = _mm_add_epi16(value, div16_sse41(_mm_mullo_epi16(up, w5)));
+                value = _mm_min_epi16(_mm_max_epi16(value, zero), max);
+                value = _mm_add_epi16(value, div16_sse41(_mm_mullo_epi16(up_right, w3)));
+                value = _mm_min_epi16(_mm_max_epi16(value, zero), max);
+
+                _mm_storel_epi64(row.add(i) as *mut __m128i, _mm_packus_epi16(value, value));
+            }
+            i += 8;
+        }
+
+        diffuse_down_scalar_from(next_row, errors, i);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::format::{format_image, FRAMESIZE};
+
+    /// xorshift, so the images are random but the same every run
+    struct Rng(u64);
+
+    impl Rng {
+        fn next(&mut self) -> u64 {
+            self.0 ^= self.0 << 13;
+            self.0 ^= self.0 >> 7;
+            self.0 ^= self.0 << 17;
+            self.0
+        }
+
+        fn below(&mut self, n: usize) -> usize {
+            (self.next() % n as u64) as usize
+        }
+
+        fn fill(&mut self, bytes: &mut [u8]) {
+            bytes.iter_mut().for_each(|b| *b = self.next() as u8);
+        }
+
+        fn image(&mut self, width: usize, height: usize, bpp: usize) -> Vec<u8> {
+            let mut image = vec![0u8; width * height * bpp];
+            self.fill(&mut image);
+            image
+        }
+    }
+
+    /// The plain one-pixel-at-a-time Floyd-Steinberg loop everything
+    /// here has to match, on its own copy of the image, with every
+    /// neighbour getting a saturating add as soon as its error is
+    /// known. Returns 6bpp pixels.
+    fn reference_dither(src: &[u8], width: usize, height: usize, bpp: usize) -> Vec<u8> {
+        let mut image: Vec<u8> = src.chunks_exact(bpp).flat_map(|px| px[..3].to_vec()).collect();
+        let add = |image: &mut Vec<u8>, x: usize, y: usize, error: [i16; 3], weight: i16| {
+            for c in 0..3 {
+                let i = (y * width + x) * 3 + c;
+                image[i] = image[i].saturating_add_signed((error[c] * weight / 16) as i8);
+            }
+        };
+        for y in 0..height {
+            for x in 0..width {
+                let i = (y * width + x) * 3;
+                let mut error = [0i16; 3];
+                for c in 0..3 {
+                    let quantized = (image[i + c] >> 6) * 85;
+                    error[c] = image[i + c] as i16 - quantized as i16;
+                    image[i + c] = quantized;
+                }
+                if x + 1 < width {
+                    add(&mut image, x + 1, y, error, 7);
+                }
+                if y + 1 < height {
+                    if x > 0 {
+                        add(&mut image, x - 1, y + 1, error, 3);
+                    }
+                    add(&mut image, x, y + 1, error, 5);
+                    if x + 1 < width {
+                        add(&mut image, x + 1, y + 1, error, 1);
+                    }
+                }
+            }
+        }
+        image.chunks_exact(3).map(rgb8_to_6bpp).collect()
+    }
+
+    /// Pack 6bpp pixels into Sharpie rows.
+    fn to_sharpie(pixels: &[u8], width: usize) -> Vec<u8> {
+        let mut out = vec![0u8; pixels.len()];
+        for (row, out_row) in pixels.chunks_exact(width).zip(out.chunks_exact_mut(width)) {
+            let (msbs, lsbs) = out_row.split_at_mut(width / 2);
+            for ((msb, lsb), pair) in msbs.iter_mut().zip(lsbs).zip(row.chunks_exact(2)) {
+                (*msb, *lsb) = two_pixels_to_msb_lsb(pair[0], pair[1]);
+            }
+        }
+        out
+    }
+
+    // odd widths, widths that aren't a whole number of wavefront
+    // chunks or SIMD vectors, and the real screen
+    const SIZES: [(usize, usize); 7] = [(1, 5), (2, 1), (7, 9), (16, 4), (17, 13), (46, 31), (240, 320)];
+
+    #[test]
+    fn serial_matches_reference() {
+        let mut rng = Rng(1);
+        for (width, height) in SIZES {
+            for bpp in [3, 4] {
+                let src = rng.image(width, height, bpp);
+                let mut out = vec![0u8; width * height];
+                Ditherer::new(width, 1).dither_to_6bpp(&src, bpp, &mut out);
+                assert_eq!(out, reference_dither(&src, width, height, bpp),
+                           "{}x{} at {} bytes per pixel", width, height, bpp);
+            }
+        }
+    }
+
+    #[test]
+    fn wavefront_matches_reference() {
+        let mut rng = Rng(2);
+        for (width, height) in SIZES {
+            let src = rng.image(width, height, 3);
+            let expected = reference_dither(&src, width, height, 3);
+            for threads in [2, 3, 4, 8] {
+                let mut ditherer = Ditherer::new(width, threads);
+                let mut out = vec![0u8; width * height];
+                // twice, since the second frame reuses the shared state
+                for _ in 0..2 {
+                    ditherer.dither_to_6bpp(&src, 3, &mut out);
+                    assert_eq!(out, expected, "{}x{} with {} threads", width, height, threads);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn sharpie_packing_matches_reference() {
+        let mut rng = Rng(3);
+        for (width, height) in SIZES.into_iter().filter(|(width, _)| width % 2 == 0) {
+            for bpp in [3, 4] {
+                let src = rng.image(width, height, bpp);
+                let expected = to_sharpie(&reference_dither(&src, width, height, bpp), width);
+                for threads in [1, 2, 4] {
+                    let mut out = vec![0u8; width * height];
+                    Ditherer::new(width, threads).dither_to_sharpie(&src, bpp, &mut out);
+                    assert_eq!(out, expected, "{}x{} at {} bytes per pixel with {} threads",
+                               width, height, bpp, threads);
+                }
+            }
+        }
+
+        // and the same as formatting a dithered screen
+        let src = rng.image(240, 320, 4);
+        let mut pixels = vec![0u8; FRAMESIZE];
+        Ditherer::new(240, 1).dither_to_6bpp(&src, 4, &mut pixels);
+        let mut formatted = vec![0u8; FRAMESIZE];
+        format_image(&pixels, &mut formatted);
+        let mut out = vec![0u8; FRAMESIZE];
+        Ditherer::new(240, 1).dither_to_sharpie(&src, 4, &mut out);
+        assert_eq!(out, formatted);
+    }
+
+    #[cfg(target_arch = "x86_64")]
+    #[test]
+    fn simd_diffuse_down_matches_scalar() {
+        let mut versions: Vec<(&str, DiffuseDownFn)> = Vec::new();
+        if is_x86_feature_detected!("avx2") {
+            versions.push(("avx2", x86::diffuse_down_avx2_safe));
+        }
+        if is_x86_feature_detected!("sse4.1") {
+            versions.push(("sse4.1", x86::diffuse_down_sse41_safe));
+        }
+
+        let mut rng = Rng(4);
+        for len in (0..=100).chain([240 * 3]) {
+            for _ in 0..20 {
+                let mut row = vec![0u8; len];
+                rng.fill(&mut row);
+                // push some bytes to the ends, so the adds saturate
+                for b in row.iter_mut() {
+                    match rng.below(8) {
+                        0 => *b = 0,
+                        1 => *b = 255,
+                        _ => (),
+                    }
+                }
+                // real errors are in -63..=63, with the padding zero
+                let mut errors = vec![0i8; len + 2 * ERROR_PAD];
+                for e in &mut errors[ERROR_PAD..ERROR_PAD + len] {
+                    *e = rng.below(127) as i8 - 63;
+                }
+
+                let mut expected = row.clone();
+                diffuse_down_scalar(&mut expected, &errors);
+                for (name, diffuse_down) in &versions {
+                    let mut out = row.clone();
+                    diffuse_down(&mut out, &errors);
+                    assert_eq!(out, expected, "{} on {} bytes", name, len);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn damage_matches_full_dither() {
+        let mut rng = Rng(5);
+        for (width, height) in [(2, 1), (16, 4), (46, 31), (240, 320)] {
+            let mut src = rng.image(width, height, 4);
+            let mut damage = DamageDitherer::new(width);
+            let mut full = Ditherer::new(width, 1);
+            let mut out = vec![0u8; width * height];
+            let mut expected = vec![0u8; width * height];
+            let mut last = vec![0u8; width * height];
+
+            assert_eq!(damage.dither_to_sharpie(&src, 4, &mut out), Some(0..height));
+            full.dither_to_sharpie(&src, 4, &mut expected);
+            assert_eq!(out, expected, "{}x{} first frame", width, height);
+
+            for frame in 1..30 {
+                // sometimes nothing changes, otherwise a few scattered
+                // pixels, some of them barely
+                let changes = if frame % 5 == 0 { 0 } else { 1 + rng.below(4) };
+                for _ in 0..changes {
+                    let (x, y) = (rng.below(width), rng.below(height));
+                    let c = rng.below(3);
+                    let byte = &mut src[(y * width + x) * 4 + c];
+                    *byte = if rng.below(2) == 0 { byte.wrapping_add(1) } else { rng.next() as u8 };
+                }
+                // alpha is ignored, but it's still a change in the source
+                if changes > 0 {
+                    let alpha = (rng.below(height) * width + rng.below(width)) * 4 + 3;
+                    src[alpha] = src[alpha].wrapping_add(1);
+                }
+
+                last.copy_from_slice(&out);
+                let rows = damage.dither_to_sharpie(&src, 4, &mut out);
+                full.dither_to_sharpie(&src, 4, &mut expected);
+                assert_eq!(out, expected, "{}x{} frame {}", width, height, frame);
+
+                // every row that came out different has to be in the
+                // range
+                let different = (0..height)
+                    .filter(|&y| out[y * width..(y + 1) * width] != last[y * width..(y + 1) * width]);
+                match &rows {
+                    None => assert_eq!(different.count(), 0, "{}x{} frame {}", width, height, frame),
+                    Some(rows) => {
+                        for y in different {
+                            assert!(rows.contains(&y), "{}x{} frame {} row {}", width, height, frame, y);
+                        }
+                        assert!(rows.end <= height);
+                    }
+                }
+                if changes == 0 {
+                    assert_eq!(rows, None, "{}x{} frame {}", width, height, frame);
+                }
+            }
+        }
+    }
+}
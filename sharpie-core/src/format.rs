@@ -0,0 +1,82 @@
+// Sharpie frame formatting. the display takes each row as 120 bytes
+// of color MSbs followed by 120 bytes of color LSbs, with two pixels
+// packed into every byte.
+//
+// the host's encoder doesn't use format_image, because the ditherer
+// writes formatted rows itself (see `Ditherer::dither_to_sharpie`),
+// but the formatter does, and it's the straightforward reference for
+// what the ditherer has to produce.
+//
+// none of this uses lookup tables or per-pixel branches: it's all
+// masks and shifts on whole bytes, so the compiler vectorizes the row
+// loops on its own.
+
+/// Bytes in a formatted frame, and also pixels in a frame.
+pub const FRAMESIZE: usize = 240*320;
+
+/// Pixels per row.
+const WIDTH: usize = 240;
+
+/// Where the red, green, and blue bits of one plane (MSb or LSb) of a
+/// 0bBBGGRR pixel end up in a formatted byte: the first pixel takes
+/// the even bits and the second pixel the odd ones.
+const EVEN_BITS: u8 = 0b010101;
+const ODD_BITS: u8 = 0b101010;
+
+/// Convert a packed RGB8 (or RGBA, anything past blue is ignored)
+/// pixel to a single byte in 0bBBGGRR format, by keeping the top two
+/// bits of every channel.
+#[inline(always)]
+pub fn rgb8_to_6bpp(rgb: &[u8]) -> u8 {
+    (rgb[0] >> 6) | ((rgb[1] >> 6) << 2) | ((rgb[2] >> 6) << 4)
+}
+
+/// Convert two pixels in 0bBBGGRR format to their respective MSb and
+/// LSb bytes.
+#[inline(always)]
+pub fn two_pixels_to_msb_lsb(p1: u8, p2: u8) -> (u8, u8) {
+    // every channel's MSb is the odd bit of its pair and the LSb is
+    // the even one. the MSb byte gets the first pixel's MSbs moved down
+    // into the even positions and the second pixel's MSbs where they
+    // already are, and the LSb byte is the same thing shifted over by
+    // one.
+    let msb = ((p1 >> 1) & EVEN_BITS) | (p2 & ODD_BITS);
+    let lsb = (p1 & EVEN_BITS) | ((p2 << 1) & ODD_BITS);
+    (msb, lsb)
+}
+
+/// Undo `two_pixels_to_msb_lsb`.
+#[inline(always)]
+pub fn msb_lsb_to_two_pixels(msb: u8, lsb: u8) -> (u8, u8) {
+    let p1 = ((msb & EVEN_BITS) << 1) | (lsb & EVEN_BITS);
+    let p2 = (msb & ODD_BITS) | ((lsb & ODD_BITS) >> 1);
+    (p1, p2)
+}
+
+/// Format a flat 240x320 slice of 6bpp pixels (like the ditherer
+/// makes) into a Sharpie frame.
+pub fn format_image(img: &[u8], formatted: &mut [u8]) {
+    assert_eq!(img.len(), FRAMESIZE);
+    assert_eq!(formatted.len(), FRAMESIZE);
+
+    for (row, out) in img.chunks_exact(WIDTH).zip(formatted.chunks_exact_mut(WIDTH)) {
+        let (msbs, lsbs) = out.split_at_mut(WIDTH / 2);
+        for ((pair, msb), lsb) in row.chunks_exact(2).zip(msbs).zip(lsbs) {
+            (*msb, *lsb) = two_pixels_to_msb_lsb(pair[0], pair[1]);
+        }
+    }
+}
+
+/// Turn a formatted frame back into 6bpp (0bBBGGRR) pixels, one byte
+/// per pixel. This undoes `format_image`.
+pub fn unformat_image(formatted: &[u8], img: &mut [u8]) {
+    assert_eq!(formatted.len(), FRAMESIZE);
+    assert_eq!(img.len(), FRAMESIZE);
+
+    for (row, out) in formatted.chunks_exact(WIDTH).zip(img.chunks_exact_mut(WIDTH)) {
+        let (msbs, lsbs) = row.split_at(WIDTH / 2);
+        for ((pair, msb), lsb) in out.chunks_exact_mut(2).zip(msbs).zip(lsbs) {
+            (pair[0], pair[1]) = msb_lsb_to_two_pixels(*msb, *lsb);
+        }
+    }
+}
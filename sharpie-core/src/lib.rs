@@ -0,0 +1,8 @@
+// The per-pixel kernels that sharpie-formatter and usb-display-host
+// both need: Floyd-Steinberg dithering down to 6bpp, and packing 6bpp
+// pixels into Sharpie's MSb/LSb row format (and back). They used to be
+// copied between the two, which meant every speedup had to be done
+// twice, and the benchmarks only ever covered one copy.
+
+pub mod dither;
+pub mod format;
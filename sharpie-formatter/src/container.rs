@@ -0,0 +1,75 @@
+// Writes Sharpie video containers: a whole video's worth of frames,
+// already compressed and ready to send, that usb-display-host can play
+// with `--container` without decoding, dithering, or compressing
+// anything. See container.rs in usb-display-host, which reads them,
+// for the layout. The two have to agree.
+
+use std::fs::File;
+use std::io::{self, BufWriter, Seek, SeekFrom, Write};
+use std::path::Path;
+
+const MAGIC: &[u8; 8] = b"SHARPIEV";
+const VERSION: u32 = 2;
+const HEADER_SIZE: u64 = 32;
+
+/// Size of the header on every message to Sharpie. This has to match
+/// HEADER_SIZE in usb-display-host's protocol.rs.
+const MESSAGE_HEADER_SIZE: usize = 40;
+
+/// The biggest zstd window Sharpie takes. This has to match
+/// MAX_WINDOW_LOG in usb-display-host's protocol.rs.
+pub const MAX_WINDOW_LOG: u32 = 13;
+
+pub struct ContainerWriter {
+    file: BufWriter<File>,
+    /// where every frame's message starts
+    offsets: Vec<u64>,
+    position: u64,
+}
+
+impl ContainerWriter {
+    /// Start a container at `path`. Every frame after this gets
+    /// compressed with `dictionary` (which can be empty).
+    pub fn create(path: &Path, framerate: u32, dictionary: &[u8]) -> io::Result<ContainerWriter> {
+        let mut file = BufWriter::new(File::create(path)?);
+        // the frame count and index offset get filled in by finish()
+        file.write_all(MAGIC)?;
+        file.write_all(&VERSION.to_le_bytes())?;
+        file.write_all(&0u32.to_le_bytes())?;
+        file.write_all(&framerate.to_le_bytes())?;
+        file.write_all(&(dictionary.len() as u32).to_le_bytes())?;
+        file.write_all(&0u64.to_le_bytes())?;
+        file.write_all(dictionary)?;
+        Ok(ContainerWriter {
+            file,
+            offsets: Vec::new(),
+            position: HEADER_SIZE + dictionary.len() as u64,
+        })
+    }
+
+    /// Add a zstd-compressed formatted frame, as a full frame message
+    /// that can be sent to Sharpie as-is.
+    pub fn add_frame(&mut self, compressed: &[u8]) -> io::Result<()> {
+        // payload size, payload type 0 (frame), no row ranges
+        let mut header = [0u8; MESSAGE_HEADER_SIZE];
+        header[0..4].copy_from_slice(&(compressed.len() as u32).to_le_bytes());
+        self.file.write_all(&header)?;
+        self.file.write_all(compressed)?;
+        self.offsets.push(self.position);
+        self.position += (MESSAGE_HEADER_SIZE + compressed.len()) as u64;
+        Ok(())
+    }
+
+    /// Write the index and fill in the header.
+    pub fn finish(mut self) -> io::Result<()> {
+        let index_offset = self.position;
+        for offset in &self.offsets {
+            self.file.write_all(&offset.to_le_bytes())?;
+        }
+        self.file.seek(SeekFrom::Start(12))?;
+        self.file.write_all(&(self.offsets.len() as u32).to_le_bytes())?;
+        self.file.seek(SeekFrom::Start(24))?;
+        self.file.write_all(&index_offset.to_le_bytes())?;
+        self.file.flush()
+    }
+}
@@ -7,6 +7,10 @@ use image::metadata::{Cicp};
 use clap::{Parser, Subcommand};
 use glob::glob;
 use rayon::prelude::*;
+use sharpie_core::dither;
+use sharpie_core::format::{self, rgb8_to_6bpp, FRAMESIZE};
+
+mod container;
 
 #[derive(Subcommand, Debug)]
 enum Commands {
@@ -67,6 +71,22 @@ enum Commands {
         input_dir: PathBuf,
         output_dir: PathBuf,
     },
+
+    /// Take a directory of 4:3 aspect ratio PNGs (like
+    /// full-format-dir), and encode them, in filename order, into a
+    /// single Sharpie video container that usb-display-host can play
+    /// with --container.
+    EncodeContainer {
+        input_dir: PathBuf,
+        output: PathBuf,
+        /// Framerate the frames were extracted at
+        #[arg(long, default_value_t = 21)]
+        framerate: u32,
+        /// zstd dictionary to compress frames with (make one with
+        /// usb-display-host's --train-dictionary)
+        #[arg(long)]
+        dictionary: Option<PathBuf>,
+    },
     
     
 }
@@ -77,47 +97,6 @@ struct Args {
     command: Commands,
 }
 
-/// Convert two pixels in 0bBBGGRR format to their respective MSb and
-/// LSb bytes.
-fn two_pixels_to_msb_lsb(p1: u8, p2: u8) -> (u8, u8) {
-    // apply a linear mapping from 24-bit color to 6-bit color
-    let p1red = p1 & 0b11;
-    let p1green = (p1 & 0b1100) >> 2;
-    let p1blue = (p1 & 0b110000) >> 4;
-    let p2red = p2 & 0b11;
-    let p2green = (p2 & 0b1100) >> 2;
-    let p2blue = (p2 & 0b110000) >> 4;
-
-    // get the MSbs of both pixels, each of these values is 0
-    // or 1
-    let p1red_m = p1red >> 1;
-    let p1green_m = p1green >> 1;
-    let p1blue_m = p1blue >> 1;
-    let p2red_m = p2red >> 1;
-    let p2green_m = p2green >> 1;
-    let p2blue_m = p2blue >> 1;
-
-    // assemble the MSb byte: the second pixel goes in the higher
-    // position while the first goes in the lower (this was wrong
-    // before)
-    let msb = (p2blue_m << 5) | (p2green_m << 3) | (p2red_m << 1)
-	| (p1blue_m << 4) | (p1green_m << 2) | (p1red_m);
-    
-    // now find LSBs from both pixels
-    let p1red_l = p1red & 1;
-    let p1green_l = p1green & 1;
-    let p1blue_l = p1blue & 1;
-    let p2red_l = p2red & 1;
-    let p2green_l = p2green & 1;
-    let p2blue_l = p2blue & 1;
-    
-    // and write to formatted array as LSBs in 0bB1B2G1G2R1R2
-    let lsb = (p2blue_l << 5) | (p2green_l << 3) | (p2red_l << 1)
-	| (p1blue_l << 4) | (p1green_l << 2) | (p1red_l);
-
-    (msb, lsb)
-}
-
 // this isn't very good code because it doesn't need to be
 fn incorrect_format_image(img: &RgbImage) -> Vec<u8> {
     let mut formatted = Vec::<u8>::new();
@@ -132,52 +111,16 @@ fn incorrect_format_image(img: &RgbImage) -> Vec<u8> {
     formatted
 }
 
-fn format_image(img: &RgbImage) -> [u8; 240*320] {
-    // formatted image buffer
-    let mut formatted: [[u8; 240]; 320] = [[0; 240]; 320];
-    for y in 0..320 {
-	let mut formatted_index = 0;
-	for x in (0..240).step_by(2) {
-	    //println!("y: {}, x: {}, formatted_index: {}", y, x, formatted_index);
-	    // get msb of color components from pixels 1 and 2
-	    let p1 = img.get_pixel(x, y);
-	    let p1_components = p1.channels();
-	    let p2 = img.get_pixel(x+1, y);
-	    let p2_components = p2.channels();
-	    
-	    // apply a linear mapping from 24-bit color to 6-bit color
-	    // (this is not actually correct, the display has skew
-	    // toward the MSB due to the way subpixels are arranged)
-	    let p1red_2bit = p1_components[0] >> 6;
-	    let p1green_2bit = p1_components[1] >> 6;
-	    let p1blue_2bit = p1_components[2] >> 6;
-	    let p2red_2bit = p2_components[0] >> 6;
-	    let p2green_2bit = p2_components[1] >> 6;
-	    let p2blue_2bit = p2_components[2] >> 6;
-
-	    // reassemble pixels as 0bBBGGRR
-	    let p1 = (p1blue_2bit << 4) | (p1green_2bit << 2) | (p1red_2bit);
-	    let p2 = (p2blue_2bit << 4) | (p2green_2bit << 2) | (p2red_2bit);
-	    let (msb, lsb) = two_pixels_to_msb_lsb(p1, p2);
-
-	    formatted[y as usize][formatted_index as usize] = msb;
-
-	    formatted[y as usize][(formatted_index + 120) as usize] = lsb;
-            
-	    
-	    formatted_index += 1;
-	}
-    }
-
-    let mut formatted_flattened: [u8; 320*240] = [0; 320*240];
-    for (rowcount, row) in formatted.iter().enumerate() {
-	for (colcount, px) in row.iter().enumerate() {
-	    //println!("rowcount: {}, colcount: {}", rowcount, colcount);
-	    formatted_flattened[rowcount*240 + colcount] = *px;
-	}
-    }
-    
-    formatted_flattened
+/// Format an image into a raw Sharpie frame without dithering it,
+/// by just keeping the top two bits of every channel.
+fn format_image(img: &RgbImage) -> Vec<u8> {
+    // apply a linear mapping from 24-bit color to 6-bit color (this
+    // is not actually correct, the display has skew toward the MSB
+    // due to the way subpixels are arranged)
+    let pixels_6bpp: Vec<u8> = img.as_raw().chunks_exact(3).map(rgb8_to_6bpp).collect();
+    let mut formatted = vec![0u8; FRAMESIZE];
+    format::format_image(&pixels_6bpp, &mut formatted);
+    formatted
 }
 
 fn unformat_image(input: PathBuf) -> RgbImage {
@@ -192,27 +135,12 @@ fn unformat_image(input: PathBuf) -> RgbImage {
     // convert pixels back we expect them to be going into an sRGB
     // linear image.
     imgbuf.set_color_space(Cicp::SRGB_LINEAR).unwrap();
-    for row in 0..320 {
-	let mut formatted_col = 0;
-	for col in (0..240).step_by(2) {
-	    let msb = formatted[row*240 + formatted_col];
-	    let lsb = formatted[row*240 + (formatted_col+120)];
-	    let p1_red = (msb & 0b10) | ((lsb & 0b10) >> 1);
-	    let p1_green = ((msb & 0b1000) >> 2) | ((lsb & 0b1000) >> 3);
-	    let p1_blue = ((msb & 0b100000) >> 4) | ((lsb & 0b100000) >> 5);
-
-	    let p0_red = (msb & 0b1) << 1 | (lsb & 0b1);
-	    let p0_green = (((msb & 0b100) >> 2) << 1) | ((lsb & 0b100) >> 2);
-	    let p0_blue = ((msb & 0b10000) >> 3) | ((lsb & 0b10000) >> 4);
-	    
-	    let p0: [u8; 3] = [p0_red << 6, p0_green << 6, p0_blue << 6];
-	    let p1: [u8; 3] = [p1_red << 6, p1_green << 6, p1_blue << 6];
-	    
-	    imgbuf.put_pixel(col, row as u32, Rgb(p0));
-	    imgbuf.put_pixel(col+1, row as u32, Rgb(p1));
-	    
-	    formatted_col += 1;
-	}
+    let mut pixels_6bpp = vec![0u8; FRAMESIZE];
+    format::unformat_image(&formatted, &mut pixels_6bpp);
+    for (px, px_6bpp) in imgbuf.pixels_mut().zip(pixels_6bpp) {
+	*px = Rgb([(px_6bpp & 0b11) << 6,
+		   ((px_6bpp >> 2) & 0b11) << 6,
+		   ((px_6bpp >> 4) & 0b11) << 6]);
     }
 
     imgbuf
@@ -236,104 +164,43 @@ fn color_2bit_to_8bit(color_2bit: u8) -> u8 {
 
 }
 
-/// Returns the 2bpc (2 bits per color) equivalent of an Rgb pixel and
-/// the correctly scaled Rgb pixel that represents that 2bpp pixel.
-fn rgb8_to_2bpc_pixels(input_pixel: &[u8]) -> [u8; 3] {
-    [input_pixel[0] >> 6, input_pixel[1] >> 6, input_pixel[2] >> 6]
-}
-
-/// Convert a Rgb pixel to a single u8 in 0bBBGGRR format
-fn rgb8_to_6bpp_pixel(input_pixel: &[u8]) -> u8 {
-    (input_pixel[0] >> 6) | ((input_pixel[1] >> 6) << 2) | ((input_pixel[2] >> 6) << 4)
-}
-
-
-fn rgb8_quant_error(pixel: &[u8], difference: [i16; 3], quant_num: i16) -> Rgb<u8> {
-    // we have to clamp overflows to 255 with a saturating signed add,
-    // otherwise channels that saturate will underflow, causing (for
-    // example) some bright white pixels in the original image to
-    // appear as a full blue pixel in the dithered output. the max
-    // difference is +/- 63 and quant_num is always less than 16, so
-    // we can safely cast to i8 without losing anything.
-    Rgb([pixel[0].saturating_add_signed((difference[0] * quant_num/16) as i8),
-	 pixel[1].saturating_add_signed((difference[1] * quant_num/16) as i8),
-	 pixel[2].saturating_add_signed((difference[2] * quant_num/16) as i8)])
-}
+/// Dither an image with Floyd-Steinberg dithering, using `threads`
+/// threads (see dither.rs). This returns an RgbImage which can then be
+/// formatted or saved.
+fn floyd_steinberg_dither(input: &RgbImage, threads: usize) -> RgbImage {
+    let mut ditherer = dither::Ditherer::new(input.width() as usize, threads);
+    let mut pixels_6bpp = vec![0u8; (input.width() * input.height()) as usize];
+    ditherer.dither_to_6bpp(input.as_raw(), 3, &mut pixels_6bpp);
 
-/// Dither an image (specified in `input_file`) with Floyd-Steinberg
-/// dithering. This returns an RgbImage which can then be formatted or
-/// saved.
-fn floyd_steinberg_dither(input: &RgbImage) -> RgbImage {
+    // cloning keeps the color space of the input, and then we
+    // overwrite every pixel with its full range 2bpc version
     let mut img_buffer = input.clone();
-
-    for y in 0..img_buffer.height() {
-	for x in 0..img_buffer.width() {
-	    // for each pixel, get its color channels, then convert
-	    // it to 2bpc and calculate the quantization error.
-	    let oldpixel = img_buffer.get_pixel(x, y);
-	    let oldpixel_slice = oldpixel.channels();
-	    let newpixel_2bpc = rgb8_to_2bpc_pixels(oldpixel_slice);
-	    // make an 8bpc version of the new pixel to put back in
-	    // the original image, where we keep the initial state and
-	    // diffused error (which gets transformed into a dithered
-	    // image in 8bpc format)
-	    let newpixel_8bpc = Rgb([color_2bit_to_8bit(newpixel_2bpc[0]),
-				     color_2bit_to_8bit(newpixel_2bpc[1]),
-				     color_2bit_to_8bit(newpixel_2bpc[2])]);
-	    
-	    // we need to use a signed size bigger than u8 to hold the
-	    // quantization error, but i16 is probably not the most
-	    // optimized size to use here
-	    let quant_error: [i16; 3] =
-		[i16::from(oldpixel_slice[0]) - i16::from(newpixel_8bpc[0]),
-		 i16::from(oldpixel_slice[1]) - i16::from(newpixel_8bpc[1]),
-		 i16::from(oldpixel_slice[2]) - i16::from(newpixel_8bpc[2])];
-
-	    // put the quantized pixel back into the original image
-	    img_buffer.put_pixel(x, y, newpixel_8bpc);
-
-	    // and then diffuse the error over adjacent pixels
-	    
-	    // if we're in a position that would write to pixels outside the image,
-	    // just don't write them.
-	    if x + 1 < img_buffer.width() {
-		img_buffer.put_pixel(
-		    x + 1,
-		    y,
-		    rgb8_quant_error(img_buffer.get_pixel(x + 1, y).channels(),
-				     quant_error, 7));
-	    }
-
-	    if x != 0 && y + 1 < img_buffer.height() {
-		img_buffer.put_pixel(
-		    x - 1,
-		    y + 1,
-		    rgb8_quant_error(img_buffer.get_pixel(x - 1, y + 1).channels(),
-				     quant_error, 3));
-	    }
-
-	    if y + 1 < img_buffer.height() {
-		img_buffer.put_pixel(
-		    x,
-		    y + 1,
-		    rgb8_quant_error(img_buffer.get_pixel(x, y + 1).channels(),
-				     quant_error, 5));
-	    }
-
-	    if x + 1 < img_buffer.width() && y + 1 < img_buffer.height() {
-		img_buffer.put_pixel(
-		    x + 1,
-		    y + 1,
-		    rgb8_quant_error(img_buffer.get_pixel(x + 1, y + 1).channels(),
-				     quant_error, 1));
-	    }
-	}
-
+    for (px, px_6bpp) in img_buffer.pixels_mut().zip(pixels_6bpp) {
+        *px = Rgb([color_2bit_to_8bit(px_6bpp & 0b11),
+                   color_2bit_to_8bit((px_6bpp >> 2) & 0b11),
+                   color_2bit_to_8bit((px_6bpp >> 4) & 0b11)]);
     }
 
     img_buffer
 }
 
+/// Dither a 240 pixel wide image straight into a raw Sharpie frame.
+/// This gives the same bytes as `format_image(&floyd_steinberg_dither(..))`
+/// without building the dithered image in between.
+fn dither_and_format(input: &RgbImage, threads: usize) -> Vec<u8> {
+    let mut ditherer = dither::Ditherer::new(input.width() as usize, threads);
+    let mut formatted = vec![0u8; (input.width() * input.height()) as usize];
+    ditherer.dither_to_sharpie(input.as_raw(), 3, &mut formatted);
+    formatted
+}
+
+/// How many threads to dither a single image with. Commands that work
+/// on a whole directory already dither one image per thread, so they
+/// stick to 1.
+fn single_image_dither_threads() -> usize {
+    std::thread::available_parallelism().map_or(1, |n| n.get())
+}
+
 fn unformat_image_raw(input: PathBuf, output: PathBuf) {
     // unformat an image, but save it as raw bytes, not an image format
     let formatted = fs::read(input).expect("Failed to read input file");
@@ -430,6 +297,28 @@ fn load_240x320_image(input: PathBuf) -> RgbImage {
 
 }*/
 
+/// Rotate, resize, dither, and format a 4:3 aspect ratio image of any
+/// size into a raw Sharpie frame.
+fn full_format_image(input_path: &Path) -> Vec<u8> {
+    let mut img = ImageReader::open(input_path).expect("Failed to read image")
+	.decode().expect("Failed to decode image");
+
+    
+    img.set_color_space(Cicp::SRGB_LINEAR).unwrap();
+    
+    if img.width() as f32 / img.height() as f32 != 4_f32 / 3_f32 {
+        panic!("Image {:?} is not 4:3 aspect ratio!", input_path);
+    }
+    
+    // nearest neighbor is totally fine
+    let resized = img.resize(320, 240, imageops::FilterType::Nearest);
+
+    let rotated = resized.rotate270();
+
+    let rgb8_image = rotated.into_rgb8();
+    dither_and_format(&rgb8_image, 1)
+}
+
 fn full_format_dir(input_dir: PathBuf, output_dir: PathBuf) {
     let p = Path::new(&input_dir).join("*.png");
     glob(p.to_str().unwrap()).unwrap()
@@ -439,30 +328,55 @@ fn full_format_dir(input_dir: PathBuf, output_dir: PathBuf) {
             let output_path = Path::new(&output_dir)
                 .join(input_path.file_name().unwrap()).with_added_extension("bin");
             println!("processing {:?}", input_path);
-            let mut img = ImageReader::open(&input_path).expect("Failed to read image")
-	        .decode().expect("Failed to decode image");
-
-            
-            img.set_color_space(Cicp::SRGB_LINEAR).unwrap();
-            
-            if img.width() as f32 / img.height() as f32 != 4_f32 / 3_f32 {
-                panic!("Image {:?} is not 4:3 aspect ratio!", &input_path);
-            }
-            
-            // nearest neighbor is totally fine
-            let resized = img.resize(320, 240, imageops::FilterType::Nearest);
-
-            let rotated = resized.rotate270();
-
-            let rgb8_image = rotated.into_rgb8();
-            let dithered = floyd_steinberg_dither(&rgb8_image);
-            let formatted = format_image(&dithered);
+            let formatted = full_format_image(&input_path);
 
             fs::write(output_path, formatted).expect("Failed to write output file");
         })
         .count();
 }
 
+/// How many frames encode_container works on at once. Frames get
+/// dithered and compressed in parallel, but they have to go into the
+/// container in order, so this keeps that many in memory.
+const CONTAINER_BATCH: usize = 256;
+
+fn encode_container(input_dir: PathBuf, output: PathBuf, framerate: u32,
+                    dictionary: Option<PathBuf>) {
+    let dictionary = dictionary
+        .map(|path| fs::read(path).expect("Failed to read dictionary"))
+        .unwrap_or_default();
+    // glob returns paths in alphabetical order, which is frame order
+    // for the numbered filenames ffmpeg and friends write
+    let p = Path::new(&input_dir).join("*.png");
+    let frames: Vec<PathBuf> = glob(p.to_str().unwrap())
+        .expect("Failed to glob input frame files!")
+        .map(|glob_entry| glob_entry.unwrap())
+        .collect();
+
+    let mut writer = container::ContainerWriter::create(&output, framerate, &dictionary)
+        .expect("Failed to create container");
+    for (batch_number, batch) in frames.chunks(CONTAINER_BATCH).enumerate() {
+        println!("encoding frames {} to {} of {}", batch_number * CONTAINER_BATCH,
+                 batch_number * CONTAINER_BATCH + batch.len(), frames.len());
+        let compressed: Vec<Vec<u8>> = batch.par_iter()
+            .map_init(
+                // same level and window as usb-display-host
+                || {
+                    let mut compressor = zstd::bulk::Compressor::with_dictionary(6, &dictionary).unwrap();
+                    compressor.set_parameter(zstd::zstd_safe::CParameter::WindowLog(container::MAX_WINDOW_LOG)).unwrap();
+                    compressor
+                },
+                |compressor, input_path| {
+                    compressor.compress(&full_format_image(input_path)).unwrap()
+                })
+            .collect();
+        for frame in compressed {
+            writer.add_frame(&frame).expect("Failed to write frame");
+        }
+    }
+    writer.finish().expect("Failed to finish container");
+}
+
 
 fn main() {
     let args = Args::parse();
@@ -491,7 +405,8 @@ fn main() {
 	Commands::Dither { input, output } => {
 	    let img = load_240x320_image(input);
 
-	    floyd_steinberg_dither(&img).save(output).unwrap();
+	    floyd_steinberg_dither(&img, single_image_dither_threads())
+                .save(output).unwrap();
 	},
 
         
@@ -509,7 +424,7 @@ fn main() {
                         .join(input_path.file_name().unwrap());
                     println!("processing {:?} to {:?}", input_path, output_path);
                     let img = load_240x320_image(input_path);
-                    floyd_steinberg_dither(&img).save(output_path).unwrap();
+                    floyd_steinberg_dither(&img, 1).save(output_path).unwrap();
                 })
                 // generally accepted way to absorb the new iterator
                 // created by map()
@@ -539,8 +454,7 @@ fn main() {
 	Commands::DitherFormat { input, output } => {
 	    let img = load_240x320_image(input);
 
-	    let dithered = floyd_steinberg_dither(&img);
-	    let formatted = format_image(&dithered);
+	    let formatted = dither_and_format(&img, single_image_dither_threads());
 	    fs::write(output, formatted).expect("Failed to write output file");
 	},
 
@@ -548,6 +462,10 @@ fn main() {
             full_format_dir(input_dir, output_dir);
         },
 
+        Commands::EncodeContainer { input_dir, output, framerate, dictionary } => {
+            encode_container(input_dir, output, framerate, dictionary);
+        },
+
     };
     
 }
@@ -0,0 +1,109 @@
+// the frame ring. core0 used to read every frame into whichever of two
+// compressed buffers core1 wasn't on, and point a volatile int at it,
+// which left one frame of slack, and nothing stopping core0 from
+// writing a buffer while core1 was still decompressing it.
+//
+// this keeps the same memory, but as one ring of bytes with frames
+// packed into it back to back, so a run of small frames (which is
+// most of them) can pile up while core1 works through a heavy one.
+// every frame's payload is in one piece, since zstd wants it that way:
+// one that doesn't fit before the end of the ring starts over at the
+// beginning instead.
+//
+// ownership goes back and forth through two counters. the producer
+// fills in a slot and then bumps `head` (release), which hands the
+// slot and its payload to the consumer. the consumer bumps `tail`
+// (release) when it's done, which hands them back. each side only
+// ever writes its own counter, so there are no locks, and on the
+// RP2350 this is just loads, stores, and barriers.
+
+#include "frame_ring.h"
+
+_Static_assert((FRAME_RING_SLOTS & (FRAME_RING_SLOTS - 1)) == 0,
+	       "FRAME_RING_SLOTS has to be a power of two");
+
+void frame_ring_init(frame_ring_t* ring, uint8_t* data, uint32_t capacity) {
+  ring->data = data;
+  ring->capacity = capacity;
+  ring->write_offset = 0;
+  ring->waiting = false;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->overruns, 0);
+}
+
+uint8_t* frame_ring_reserve(frame_ring_t* ring, uint32_t size) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  uint32_t write = ring->write_offset;
+  bool fits = false;
+  uint32_t offset = 0;
+
+  if (head - tail == FRAME_RING_SLOTS) {
+    // out of slots
+  } else if (head == tail) {
+    // empty, so start over at the beginning
+    fits = size <= ring->capacity;
+    offset = 0;
+  } else {
+    // frames from here to `write` are the consumer's. the producer
+    // never catches up to `read` from behind, so `write == read` only
+    // happens when everything in between is empty frames.
+    uint32_t read = ring->slots[tail % FRAME_RING_SLOTS].offset;
+    if (write >= read) {
+      if (size <= ring->capacity - write) {
+	fits = true;
+	offset = write;
+      } else if (size < read) {
+	fits = true;
+	offset = 0;
+      }
+    } else if (size < read - write) {
+      fits = true;
+      offset = write;
+    }
+  }
+
+  if (!fits) {
+    // count every frame that has to wait once
+    if (!ring->waiting) {
+      ring->waiting = true;
+      atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+    }
+    return NULL;
+  }
+  ring->waiting = false;
+  ring->slots[head % FRAME_RING_SLOTS].offset = offset;
+  ring->write_offset = offset + size;
+  return &ring->data[offset];
+}
+
+void frame_ring_commit(frame_ring_t* ring, const frame_header_t* header) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  ring->slots[head % FRAME_RING_SLOTS].header = *header;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+const frame_ring_slot_t* frame_ring_peek(frame_ring_t* ring) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (head == tail) {
+    return NULL;
+  }
+  return &ring->slots[tail % FRAME_RING_SLOTS];
+}
+
+const uint8_t* frame_ring_payload(const frame_ring_t* ring, const frame_ring_slot_t* slot) {
+  return &ring->data[slot->offset];
+}
+
+void frame_ring_release(frame_ring_t* ring) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+uint32_t frame_ring_count(frame_ring_t* ring) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  return head - tail;
+}
@@ -0,0 +1,71 @@
+#ifndef SHARPIE_FRAME_RING_H
+#define SHARPIE_FRAME_RING_H
+
+// a single-producer, single-consumer queue of compressed frames, which
+// is how core0 (reading USB) hands frames to core1 (decompressing
+// them). see frame_ring.c.
+//
+// this is plain C11 with no Pico SDK in it, so it builds on any host
+// too, which is how test_frame_ring.c tests it.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+// frames that can be in the ring at once. this has to be a power of
+// two, and has to match MAX_IN_FLIGHT in the host's credits.rs.
+#define FRAME_RING_SLOTS (4)
+
+typedef struct frame_ring_slot {
+  frame_header_t header;
+  // where the payload starts in the ring's data
+  uint32_t offset;
+} frame_ring_slot_t;
+
+typedef struct frame_ring {
+  // compressed frames go in here, each one in one piece
+  uint8_t* data;
+  uint32_t capacity;
+  frame_ring_slot_t slots[FRAME_RING_SLOTS];
+
+  // frames committed, only ever written by the producer. the slots
+  // from `tail` up to here belong to the consumer.
+  _Atomic uint32_t head;
+  // frames released, only ever written by the consumer. everything
+  // else belongs to the producer.
+  _Atomic uint32_t tail;
+
+  // the producer's own: where the next frame goes, and whether it's
+  // waiting for space
+  uint32_t write_offset;
+  bool waiting;
+
+  // times the producer found the ring full and had to wait for the
+  // consumer
+  _Atomic uint32_t overruns;
+} frame_ring_t;
+
+void frame_ring_init(frame_ring_t* ring, uint8_t* data, uint32_t capacity);
+
+// producer: get `size` bytes to write the next frame's payload into,
+// or NULL if there isn't room until the consumer releases something.
+// once this returns space, don't call it again until
+// frame_ring_commit().
+uint8_t* frame_ring_reserve(frame_ring_t* ring, uint32_t size);
+// producer: hand the frame in the reserved space over to the consumer
+void frame_ring_commit(frame_ring_t* ring, const frame_header_t* header);
+
+// consumer: the oldest frame, or NULL if there aren't any. it stays
+// the consumer's until frame_ring_release().
+const frame_ring_slot_t* frame_ring_peek(frame_ring_t* ring);
+const uint8_t* frame_ring_payload(const frame_ring_t* ring, const frame_ring_slot_t* slot);
+// consumer: give the oldest frame's space back to the producer
+void frame_ring_release(frame_ring_t* ring);
+
+// frames committed but not released yet (either side can call this)
+uint32_t frame_ring_count(frame_ring_t* ring);
+
+#endif
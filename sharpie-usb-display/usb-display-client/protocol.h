@@ -0,0 +1,62 @@
+#ifndef SHARPIE_PROTOCOL_H
+#define SHARPIE_PROTOCOL_H
+
+// what goes over USB between the host and the client. this has to
+// match protocol.rs and credits.rs in the host.
+
+#include <stdint.h>
+
+// the host can send just the rows that changed, in up to this many
+// ranges. this has to match MAX_RANGES in the host's partial.rs.
+#define MAX_PARTIAL_RANGES (8)
+
+// what comes after a frame_header_t
+#define PAYLOAD_FRAME (0) // zstd data for a frame
+#define PAYLOAD_DICTIONARY (1) // a zstd dictionary for every frame after it (empty to go back to no dictionary)
+#define PAYLOAD_DELTA_FRAME (2) // zstd data for a frame XORed with what's on screen
+
+// the biggest dictionary we take. this has to match
+// MAX_DICTIONARY_SIZE in the host's protocol.rs.
+#define MAX_DICTIONARY_SIZE (16384)
+
+// the biggest zstd window we decompress frames with, which is how much
+// of a frame zstd keeps around while it goes. this has to match
+// MAX_WINDOW_LOG in the host's protocol.rs.
+#define MAX_WINDOW_LOG (13)
+
+typedef struct row_range {
+  uint16_t first_row;
+  uint16_t row_count;
+} row_range_t;
+
+// every frame from the host starts with one of these (little-endian,
+// which the RP2350 is too, so we can read it straight into one)
+typedef struct frame_header {
+  // size of the data after the header
+  uint32_t payload_size;
+  uint16_t payload_type;
+  // 0 for a full frame
+  uint16_t range_count;
+  row_range_t ranges[MAX_PARTIAL_RANGES];
+} frame_header_t;
+
+// sent back to the host over the IN endpoint every time a frame is
+// decoded, so it knows how far behind we are (see credits.rs in the
+// host). all the counts start over when a dictionary message comes in,
+// which the host always sends first.
+typedef struct status_report {
+  // frames that have come in over USB
+  uint32_t frames_received;
+  // frames that core1 is done with (decoded, or thrown out), whose
+  // space in the frame ring is free again, plus frames too big to take
+  // in the first place
+  uint32_t frames_decoded;
+  // frames in the ring that haven't been decoded yet
+  uint32_t buffers_full;
+  // how long the last frame took to decompress
+  uint32_t decode_us;
+  // how long the display took to show the last frame that finished
+  uint32_t scanout_us;
+} status_report_t;
+
+#endif
@@ -13,6 +13,10 @@
 #include "sharpie-vertical.pio.h"
 #include "sharpie-gen.pio.h"
 #include "sharpie-horiz-data.pio.h"
+#include "sharpie-partial-gck.pio.h"
+#include "sharpie-partial-intb-gsp.pio.h"
+#include "sharpie-partial-gck-end.pio.h"
+#include "sharpie-partial-horiz-data.pio.h"
 // tinyusb source
 
 #include "RP2350.h"
@@ -24,19 +28,49 @@
 
 #include "zstd.h"
 
+#include "protocol.h"
+#include "frame_ring.h"
+
 #define BUFSIZE (76800)
 #define RUNS (300)
 
-typedef struct compressed_buffer {
-  uint8_t data[BUFSIZE];
-  uint32_t compressed_size;
-} compressed_buffer_t;
-
-// TODO: write directly into the buffers instead of inputbuf
-uint8_t inputbuf[BUFSIZE];
-compressed_buffer_t compressed_buffer0 = {0};
-compressed_buffer_t compressed_buffer1 = {0};
-uint8_t framebuffer[BUFSIZE];
+// frames get decompressed a band at a time into a ring that the
+// display DMA reads out of (see core1_entry()). the DMA wraps its
+// read address around the ring by itself, which needs the ring to be a
+// power of two and aligned to its size.
+#define ROW_RING_BITS (13)
+#define ROW_RING_SIZE (1 << ROW_RING_BITS)
+// how much gets decompressed at a time. this has to divide
+// ROW_RING_SIZE, so a band never wraps around the end.
+#define BAND_SIZE (1024)
+// how far ahead of the display decompression gets before the display
+// starts
+#define PREFILL_SIZE (ROW_RING_SIZE/2)
+// the display can't be paused partway through a frame, so when it
+// catches up with decompression (or gets within a band of it), this
+// many frames get decompressed all the way into `screen` first, and
+// sent from there, before core1 tries racing it again
+#define FULL_DECODE_FRAMES (30)
+_Static_assert(ROW_RING_SIZE % BAND_SIZE == 0, "bands can't wrap around row_ring");
+
+// core0 reads frames from USB straight into the frame ring, and core1
+// decompresses them in order (see frame_ring.c). this is as much
+// memory as two full-size compressed frames, which is what it used to
+// be split into.
+uint8_t compressed_data[2*BUFSIZE];
+frame_ring_t compressed_frames;
+// the last few KB of a full frame or a partial horiz/data stream, on
+// their way to the display. this replaces a whole framebuffer (two of
+// them, to keep decompression from tearing the picture).
+uint8_t row_ring[ROW_RING_SIZE] __attribute__((aligned(ROW_RING_SIZE)));
+// what's on the display right now, which delta frames get XORed
+// against
+uint8_t screen[BUFSIZE] __attribute__((aligned(4)));
+
+// core0 puts a new dictionary here, and core1 loads it between frames
+uint8_t dictionary_buffer[MAX_DICTIONARY_SIZE];
+volatile uint32_t dictionary_size = 0;
+volatile bool dictionary_pending = false;
 
 
 // USB RX buffer is 32768, TX buffer is 64
@@ -68,13 +102,35 @@ uint vertical_offset;
 uint gen_offset;
 uint horiz_data_offset;
 
+// partial updates need two more PIOs, set up the same way as in
+// sharpie-sw
+uint partial_intb_gsp_sm = 0;
+uint partial_horiz_data_sm = 1;
+
+uint partial_gck_sm = 0;
+uint partial_gck_end_sm = 1;
+
+PIO intb_gsp_horiz_pio = pio1;
+PIO gck_gck_end_pio = pio2;
+
+uint partial_intb_gsp_offset;
+uint partial_horiz_data_offset;
+uint partial_gck_offset;
+uint partial_gck_end_offset;
+
 
 uint32_t global_32bit_zero = 0;
 int image_pixels_channel;
 int image_pixels_zero_channel;
-int compressed_data_copy_channel;
-
-void send_full_frame_image(const unsigned char* source) {
+int screen_copy_channel;
+int gck_control_channel;
+int partial_data_channel;
+
+// send the image that's being decompressed into row_ring, starting at
+// `source` (somewhere in row_ring). call this once the first part of it
+// is there, and core1_entry() keeps the rest coming. if `from_ring` is
+// false, `source` is a whole image instead (that's `screen`).
+void send_full_frame_image(const unsigned char* source, bool from_ring) {
   
   // this DMA stream sends the image, and chains to `image_zero_c`,
   // which sends 120 bytes of zeros to close out the image. a change
@@ -86,6 +142,7 @@ void send_full_frame_image(const unsigned char* source) {
   channel_config_set_transfer_data_size(&image_c, DMA_SIZE_32); // four byte transfers (one byte doesn't work)
   channel_config_set_dreq(&image_c, pio_get_dreq(full_frame_pio, horiz_data_sm, true)); // true for sending data to SM
   channel_config_set_chain_to(&image_c, image_pixels_zero_channel); // chain to zero channel to start zero channel when this finishes
+  channel_config_set_ring(&image_c, false, from_ring ? ROW_RING_BITS : 0); // wrap reads around row_ring (0 doesn't wrap)
   dma_channel_configure(image_pixels_channel, &image_c,
 			&full_frame_pio->txf[horiz_data_sm], // destination (TX FIFO of SM 2)
 		        source, // source 
@@ -176,15 +233,418 @@ void reset_full_frame_pio() {
 
 
 
+// this value never changes
+const uint32_t gsp_high_timeout = 53;
+
+// GCK control data for the partial frame being sent: a skipped lines
+// count, then a changed lines count, for every range, then the lines
+// left over at the bottom. everything is -1 because of how the loops
+// in the state machine work, and a 0 at the very start means the
+// first range starts at the top of the screen.
+uint32_t gck_control_data[2*MAX_PARTIAL_RANGES + 1];
+uint32_t gck_control_count = 0;
+
+void init_partial_update_pios() {
+  // this only loads the programs. GPIO pins can only be mapped to one
+  // PIO at a time, so the state machines take over the pins in
+  // reset_partial_update_pios(), right before each partial frame.
+  partial_intb_gsp_offset = pio_add_program(intb_gsp_horiz_pio, &sharpie_partial_intb_gsp_program);
+  if (partial_intb_gsp_offset < 0) {
+    printf("failed to add partial_intb_gsp\n");
+    error_handler();
+  }
+
+  partial_horiz_data_offset = pio_add_program(intb_gsp_horiz_pio, &sharpie_partial_horiz_data_program);
+  if (partial_horiz_data_offset < 0) {
+    printf("failed to add partial_horiz_data\n");
+    error_handler();
+  }
+  
+  partial_gck_offset = pio_add_program(gck_gck_end_pio, &sharpie_partial_gck_program);
+  if (partial_gck_offset < 0) {
+    printf("failed to add partial_gck\n");
+    error_handler();
+  }
+  
+  partial_gck_end_offset = pio_add_program(gck_gck_end_pio, &sharpie_partial_gck_end_program);
+  if (partial_gck_end_offset < 0) {
+    printf("failed to add partial_gck_end\n");
+    error_handler();
+  }
+}
+
+// fill in gck_control_data for `header` (which must be a valid
+// partial frame), and return the GCK end timeout that goes with it,
+// in 1/32 GCK h/ls. this is the same math as the hand-written
+// examples in sharpie-sw/main.c, just for any set of ranges.
+uint32_t prepare_gck_control_data(const frame_header_t* header) {
+  uint32_t timeout = 0;
+  uint32_t next_row = 0;
+  gck_control_count = 0;
+  
+  for (uint32_t i = 0; i < header->range_count; i++) {
+    uint32_t first = header->ranges[i].first_row;
+    uint32_t rows = header->ranges[i].row_count;
+    uint32_t skips = first - next_row;
+
+    if (i == 0) {
+      if (skips == 0) {
+	// changes start on GCK2 when they start at the top
+	gck_control_data[gck_control_count++] = 0;
+	timeout = 1*32;
+      } else {
+	gck_control_data[gck_control_count++] = skips - 1;
+	timeout = 2*32 + skips*2;
+      }
+    } else {
+      gck_control_data[gck_control_count++] = skips - 1;
+      timeout += skips*2;
+    }
+    gck_control_data[gck_control_count++] = rows - 1;
+    // 1 extra h/l for the way GCK works
+    timeout += (rows*2 + 1)*32;
+    next_row = first + rows;
+  }
+
+  // skip the rest. the first skip after changed lines is 2x as long,
+  // and the first line is already counted at the start, which is
+  // where the -1 and +1 come from.
+  //
+  // if the last range runs to the bottom of the screen, there's
+  // nothing left to skip, but the state machine wants a counter
+  // anyway. it gets 0, which is a single short skip pulse that just
+  // lands in the end-of-frame GCKs.
+  uint32_t rest = 320 - next_row;
+  if (rest == 0) {
+    gck_control_data[gck_control_count++] = 0;
+    timeout += 1;
+  } else {
+    gck_control_data[gck_control_count++] = rest - 1;
+    timeout += (rest - 1)*2 + 1;
+  }
+
+  return timeout;
+}
+
+void reset_partial_update_pios(uint32_t gck_end_timeout) {
+  // like the full-frame PIO, we init all the state machines every
+  // frame. this also hands the GPIO pins over from the full-frame
+  // PIO.
+
+  // INTB on 0, GSP on 1
+  sharpie_partial_intb_gsp_pio_init(intb_gsp_horiz_pio, partial_intb_gsp_sm, partial_intb_gsp_offset, 0);
+  // GCK on 2, GEN on 3
+  sharpie_partial_gck_pio_init(gck_gck_end_pio, partial_gck_sm, partial_gck_offset, 2);
+  // GCK on 2 again
+  sharpie_partial_gck_end_pio_init(gck_gck_end_pio, partial_gck_end_sm, partial_gck_end_offset, 2);
+  // BSP on pin 4, BCK on pin 5, data on pins 6-11
+  sharpie_partial_horiz_data_pio_init(intb_gsp_horiz_pio, partial_horiz_data_sm, partial_horiz_data_offset, 4, 6);
+
+  // GCK end sets irq 3 every time it wraps but INTB/GSP only waits
+  // for it once, and GCK sets irq 2 once more after the end of the
+  // frame, so clear out whatever the last frame left behind.
+  intb_gsp_horiz_pio->irq = 0xff;
+  gck_gck_end_pio->irq = 0xff;
+
+  // how long the INTB/GSP SM should leave GSP high (too big for a
+  // `set` instruction)
+  pio_sm_put(intb_gsp_horiz_pio, partial_intb_gsp_sm, gsp_high_timeout);
+  
+  // important! make sure this is correctly calculated, otherwise the
+  // signals at the end of the frame will be deformed
+  pio_sm_put(gck_gck_end_pio, partial_gck_end_sm, gck_end_timeout);
+  // two more values (which don't matter) make the wrap repeat 3 times
+  pio_sm_put(gck_gck_end_pio, partial_gck_end_sm, 0);
+  pio_sm_put(gck_gck_end_pio, partial_gck_end_sm, 0);
+  // place the GCK end timeout counter in GCK end SM's x register
+  pio_sm_exec(gck_gck_end_pio, partial_gck_end_sm, pio_encode_out(pio_x, 32));
+
+  // horiz/data's inner loop counter, same as the full-frame PIO. the
+  // first changed lines counter comes from the DMA stream.
+  pio_sm_put(intb_gsp_horiz_pio, partial_horiz_data_sm, 59);
+
+  pio_clkdiv_restart_sm_mask(intb_gsp_horiz_pio, 0b11);
+  pio_clkdiv_restart_sm_mask(gck_gck_end_pio, 0b11);
+}
+
+// send the horiz/data DMA stream for the ranges in gck_control_data,
+// `stream_size` bytes long, that's being decompressed into row_ring
+// starting at `stream` (see send_full_frame_image()). call this after
+// reset_partial_update_pios().
+void send_partial_frame(const unsigned char* stream, size_t stream_size) {
+  // GCK control stream
+  dma_channel_config gck_c = dma_channel_get_default_config(gck_control_channel);
+  channel_config_set_read_increment(&gck_c, true);
+  channel_config_set_write_increment(&gck_c, false);
+  channel_config_set_transfer_data_size(&gck_c, DMA_SIZE_32); // we use the WHOLE width of the FIFO entry
+  channel_config_set_dreq(&gck_c, pio_get_dreq(gck_gck_end_pio, partial_gck_sm, true)); // true for sending data to the SM
+  dma_channel_configure(gck_control_channel, &gck_c,
+			&gck_gck_end_pio->txf[partial_gck_sm],
+			gck_control_data,
+			gck_control_count,
+			true);
+
+  // changed lines counters and pixel data for horiz/data. these
+  // transfers have to be 32 bits, just like the full-frame ones.
+  dma_channel_config data_c = dma_channel_get_default_config(partial_data_channel);
+  channel_config_set_read_increment(&data_c, true);
+  channel_config_set_write_increment(&data_c, false);
+  channel_config_set_transfer_data_size(&data_c, DMA_SIZE_32);
+  channel_config_set_dreq(&data_c, pio_get_dreq(intb_gsp_horiz_pio, partial_horiz_data_sm, true));
+  channel_config_set_ring(&data_c, false, ROW_RING_BITS);
+  dma_channel_configure(partial_data_channel, &data_c,
+			&intb_gsp_horiz_pio->txf[partial_horiz_data_sm],
+			stream,
+			stream_size/4,
+			true);
+
+  // transmit image
+  intb_gsp_horiz_pio->irq_force = 0b1;
+}
+
+// how many bytes `header`'s frame should decompress to, or 0 if the
+// header doesn't make sense. the host should never send ranges that
+// touch, overlap, or start at row 1 (which the GCK SM can't do).
+size_t expected_frame_size(const frame_header_t* header) {
+  if (header->payload_type != PAYLOAD_FRAME &&
+      header->payload_type != PAYLOAD_DELTA_FRAME) {
+    return 0;
+  }
+  if (header->range_count == 0) {
+    return BUFSIZE;
+  }
+  if (header->range_count > MAX_PARTIAL_RANGES) {
+    return 0;
+  }
+  
+  size_t size = 0;
+  uint32_t next_row = 0;
+  for (uint32_t i = 0; i < header->range_count; i++) {
+    uint32_t first = header->ranges[i].first_row;
+    uint32_t rows = header->ranges[i].row_count;
+    if (rows == 0 || first + rows > 320) {
+      return 0;
+    }
+    if (i == 0 ? first == 1 : first <= next_row) {
+      return 0;
+    }
+    size += 4 + rows*240 + 120;
+    next_row = first + rows;
+  }
+  return size;
+}
+
+// wait for the last copy into `screen` to finish. anything that reads
+// `screen` or writes row_ring has to call this first.
+void wait_for_screen_copy() {
+  dma_channel_wait_for_finish_blocking(screen_copy_channel);
+}
+
+// start a DMA copy of `words` words into `screen`, after the one
+// before it (if any) is done. core1 goes on to wait for the display
+// while this runs, instead of doing the copy itself.
+void start_screen_copy(uint32_t* screen_rows, const uint32_t* rows, uint32_t words) {
+  wait_for_screen_copy();
+  dma_channel_config copy_c = dma_channel_get_default_config(screen_copy_channel);
+  channel_config_set_read_increment(&copy_c, true);
+  channel_config_set_write_increment(&copy_c, true);
+  channel_config_set_transfer_data_size(&copy_c, DMA_SIZE_32);
+  // no DREQ, so it goes as fast as the bus lets it. the display
+  // streams only need a word every so often, and still get their turn
+  dma_channel_configure(screen_copy_channel, &copy_c,
+			screen_rows,
+			rows,
+			words,
+			true);
+}
+
+// copy `words` words of rows from a decompressed frame into `screen`,
+// or if it's a delta, XOR them with `screen` first (in place, so the
+// frame ends up holding the real rows to send)
+void apply_rows(uint32_t* rows, uint32_t* screen_rows, uint32_t words, bool delta) {
+  if (delta) {
+    wait_for_screen_copy();
+    for (uint32_t i = 0; i < words; i++) {
+      uint32_t row_word = rows[i] ^ screen_rows[i];
+      rows[i] = row_word;
+      screen_rows[i] = row_word;
+    }
+  } else {
+    start_screen_copy(screen_rows, rows, words);
+  }
+}
+
+// the part of a band that's rows from `rows_start` to `rows_end` in
+// the stream, which go at `screen_rows` on screen: bring `screen` up to
+// date with them if they were decompressed, or fill them in from
+// `screen` if they weren't
+void band_rows(uint8_t* band, uint32_t offset, uint32_t size,
+	       uint32_t rows_start, uint32_t rows_end, uint8_t* screen_rows,
+	       bool decompressed, bool delta) {
+  uint32_t from = MAX(rows_start, offset);
+  uint32_t to = MIN(rows_end, offset + size);
+  if (from >= to) {
+    return;
+  }
+  uint8_t* rows = &band[from - offset];
+  screen_rows += from - rows_start;
+  if (decompressed) {
+    apply_rows((uint32_t*)rows, (uint32_t*)screen_rows, (to - from)/4, delta);
+  } else {
+    wait_for_screen_copy();
+    memcpy(rows, screen_rows, to - from);
+  }
+}
+
+// `band` is `size` bytes of `header`'s DMA stream, starting `offset`
+// bytes in. if it was decompressed, bring `screen` up to date with the
+// rows in it. if it wasn't (the frame was bad), fill it in with what's
+// already on screen instead, so the display still gets a whole frame.
+// every row, counter, and half-line of zeros is a multiple of 4 bytes,
+// and so is every band, so none of them get split mid-word.
+void process_band(const frame_header_t* header, uint32_t offset, uint8_t* band,
+		  uint32_t size, bool decompressed) {
+  bool delta = header->payload_type == PAYLOAD_DELTA_FRAME;
+  if (header->range_count == 0) {
+    band_rows(band, offset, size, 0, BUFSIZE, screen, decompressed, delta);
+    return;
+  }
+
+  // a partial frame is a stream of counters, rows, and zeros (see
+  // send_partial_frame())
+  uint32_t range_start = 0;
+  for (uint32_t i = 0; i < header->range_count; i++) {
+    uint32_t rows = header->ranges[i].row_count;
+    uint32_t rows_start = range_start + 4;
+    uint32_t rows_end = rows_start + rows*240;
+    uint32_t range_end = rows_end + 120;
+    if (!decompressed) {
+      // the changed lines counter (see partial.rs in the host)
+      if (range_start >= offset && range_start < offset + size) {
+	*(uint32_t*)&band[range_start - offset] = rows*2;
+      }
+      uint32_t from = MAX(rows_end, offset);
+      uint32_t to = MIN(range_end, offset + size);
+      if (from < to) {
+	memset(&band[from - offset], 0, to - from);
+      }
+    }
+    band_rows(band, offset, size, rows_start, rows_end,
+	      &screen[header->ranges[i].first_row*240], decompressed, delta);
+    range_start = range_end;
+  }
+}
+
+// decompress exactly `size` bytes into `band`. false if the frame is
+// bad, or ends (or runs out of data) first.
+bool decompress_band(ZSTD_DCtx* dctx, ZSTD_inBuffer* in, uint8_t* band, size_t size) {
+  ZSTD_outBuffer out = { band, size, 0 };
+  while (out.pos < out.size) {
+    size_t in_pos = in->pos;
+    size_t out_pos = out.pos;
+    size_t ret = ZSTD_decompressStream(dctx, &out, in);
+    if (ZSTD_isError(ret) || (ret == 0 && out.pos < out.size)) {
+      return false;
+    }
+    if (in->pos == in_pos && out.pos == out_pos) {
+      return false;
+    }
+  }
+  return true;
+}
+
 const uint32_t sys_clock_hz = 200000000;
 // we know exactly how the PIO works, so we can use this for an easy
 // final delay in the core1 loop
 const uint32_t one_gck_hl_us = (1./((float)sys_clock_hz/3100.)) * 4e6;
 
+// wait for the display to finish the last frame, which has to happen
+// before the PIO can be reset for the next one, or the screen goes
+// dark
+void wait_for_display(bool partial) {
+  if (partial) {
+    while (dma_channel_is_busy(partial_data_channel) ||
+	   dma_channel_is_busy(gck_control_channel));
+    // the DMA finishes as the last changed lines go out, and then
+    // GCK end runs out the rest of the frame. INTB/GSP is done
+    // once it's wrapped back around to waiting for irq 0, and
+    // GCK end has about three h/ls left after that.
+    while (pio_sm_get_pc(intb_gsp_horiz_pio, partial_intb_gsp_sm) != partial_intb_gsp_offset);
+    sleep_us(one_gck_hl_us*4);
+  } else {
+    while (dma_channel_is_busy(image_pixels_channel) ||
+	   dma_channel_is_busy(image_pixels_zero_channel));
+    // after the DMA ends, we have five GCK h/ls to wait for. add
+    // one more for good measure
+    sleep_us(one_gck_hl_us*6);
+  }
+}
+
+// bytes of a `stream_size` byte stream the display DMA has read out of
+// row_ring so far
+uint32_t stream_consumed(bool partial, uint32_t stream_size) {
+  int channel = partial ? partial_data_channel : image_pixels_channel;
+  uint32_t words_left = dma_channel_hw_addr(channel)->transfer_count & DMA_CH0_TRANS_COUNT_COUNT_BITS;
+  return stream_size - words_left*4;
+}
+
 
-int data_ready_doorbell;
-// the framebuffer ID with the newest data in it
-volatile int newest_compressed_buffer = 0;
+
+// core0 counts these for the status reports
+volatile uint32_t frames_received = 0;
+// frames too big for us, which core0 throws out without core1 ever
+// seeing them. they count as decoded in the status reports.
+uint32_t frames_discarded = 0;
+
+// core1 fills these in for the status reports that core0 sends back to
+// the host
+volatile uint32_t frames_decoded = 0;
+volatile uint32_t last_decode_us = 0;
+volatile uint32_t last_scanout_us = 0;
+// bands that the display got to before they were decompressed, which
+// shows up as rows from a few frames ago until core1_entry() sends the
+// frame again. it falls back to decompressing whole frames first after
+// a close call, so this should hardly ever happen.
+volatile uint32_t late_bands = 0;
+
+// when core1 last started the display on a frame
+uint32_t scanout_start = 0;
+
+// wait for the display to finish the last frame (a partial one if
+// `last_partial`), and then start it on `header`'s stream, which is
+// `size` bytes at `stream` in row_ring. if `stream` is NULL, send a
+// full frame of what's in `screen` instead.
+void start_display(const frame_header_t* header, const uint8_t* stream, size_t size,
+		   bool last_partial) {
+  wait_for_display(last_partial);
+  if (scanout_start != 0) {
+    last_scanout_us = time_us_32() - scanout_start;
+  }
+  scanout_start = time_us_32();
+  if (stream == NULL) {
+    wait_for_screen_copy();
+    reset_full_frame_pio();
+    send_full_frame_image(screen, false);
+  } else if (header->range_count != 0) {
+    reset_partial_update_pios(prepare_gck_control_data(header));
+    send_partial_frame(stream, size);
+  } else {
+    reset_full_frame_pio();
+    send_full_frame_image(stream, true);
+  }
+}
+
+void send_status_report() {
+  status_report_t report = {
+    .frames_received = frames_received,
+    .frames_decoded = frames_decoded + frames_discarded,
+    .decode_us = last_decode_us,
+    .scanout_us = last_scanout_us,
+  };
+  report.buffers_full = report.frames_received - report.frames_decoded;
+  tud_vendor_write(&report, sizeof(report));
+  tud_vendor_write_flush();
+}
 
 void core1_entry() {
   CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
@@ -193,47 +653,180 @@ void core1_entry() {
 
   char str[100];
   uint32_t count = 0;
+  // the stream the display is reading (or last read) out of row_ring:
+  // where it starts, counting every byte that's gone through the ring
+  // since we started (this wraps, which is fine, since only the
+  // difference between two of these ever matters), how long it is, and
+  // which PIO it went to
+  uint32_t stream_base = 0;
+  uint32_t stream_size = 0;
+  bool last_frame_partial = false;
+  // whether the display is reading (or last read) `screen` instead of
+  // row_ring, in which case `screen` can't change until it's done, but
+  // all of row_ring is free
+  bool last_frame_from_screen = false;
+  // frames left to decompress in full before racing the display again
+  uint32_t full_decode_frames = 0;
+
+  // ZSTD_decompress() makes (and mallocs) a new context every time,
+  // so we keep one around instead
+  ZSTD_DCtx* dctx = ZSTD_createDCtx();
+  ZSTD_DDict* ddict = NULL;
+  if (dctx == NULL) {
+    error_handler();
+  }
+  // frames get decompressed a band at a time, and zstd has to keep a
+  // whole window of what came before, so a small window saves most of
+  // the memory a framebuffer took. frames with a bigger one (from an
+  // old host, say) fail to decompress instead.
+  ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, MAX_WINDOW_LOG);
+  
   while (true) {
-    if (multicore_doorbell_is_set_current_core(data_ready_doorbell)) {
+    // by the time core0 sets this, every frame from before the
+    // dictionary is already in the ring, and those still get the old
+    // one
+    if (dictionary_pending && frame_ring_count(&compressed_frames) == 0) {
+      // this copies the dictionary, so core0 can have the buffer back
+      // as soon as we're done
+      ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+      ZSTD_DCtx_refDDict(dctx, NULL);
+      ZSTD_freeDDict(ddict);
+      ddict = NULL;
+      if (dictionary_size != 0) {
+	ddict = ZSTD_createDDict(dictionary_buffer, dictionary_size);
+	ZSTD_DCtx_refDDict(dctx, ddict);
+      }
+      // a new stream starts here
+      frames_decoded = 0;
+      dictionary_pending = false;
+    }
+
+    const frame_ring_slot_t* slot = frame_ring_peek(&compressed_frames);
+    if (slot != NULL) {
       //gpio_put(led_pin, !gpio_get(led_pin));
-      multicore_doorbell_clear_current_core(data_ready_doorbell);
 
-      //multicore_doorbell_set_other_core(data_processing_doorbell);
       DWT->CYCCNT = 0;
       uint32_t compressed_size = 0;
-      size_t dsize = 0;
-      // the minute the frame size drops down to like 2000 bytes, the
-      // screen goes awry, because the PIO is getting reset during a
-      // frame (data transfer outpaces data transmission).
-      if (newest_compressed_buffer == 0) {
-	dsize = ZSTD_decompress(framebuffer, 76800,
-				compressed_buffer0.data,
-				compressed_buffer0.compressed_size);
-
-	compressed_size = compressed_buffer0.compressed_size;
-      } else if (newest_compressed_buffer == 1) {
-	dsize = ZSTD_decompress(framebuffer, 76800,
-				compressed_buffer1.data,
-				compressed_buffer1.compressed_size);
-	compressed_size = compressed_buffer1.compressed_size;
+      // core0 gets the slot back once it's decompressed, so keep our
+      // own copy of the header
+      frame_header_t frame_header = slot->header;
+      const frame_header_t* header = &frame_header;
+      size_t expected_size = expected_frame_size(header);
+      if (expected_size == 0) {
+	frame_ring_release(&compressed_frames);
+	frames_decoded++;
+	continue;
+      }
+      bool partial = header->range_count != 0;
+
+      // race the display down the screen: decompress a band at a time
+      // into row_ring, start the display once it's a ways in, and then
+      // stay ahead of it. this used to decompress the whole frame into
+      // a framebuffer first, and then send it.
+      //
+      // this frame goes in the ring right behind the last one, so it
+      // can get started while the display is still reading the end of
+      // that one.
+      //
+      // if decompression couldn't keep up with the display lately,
+      // decompress the whole frame into `screen` first instead (using
+      // row_ring for each band on the way), and send it from there.
+      bool full_decode = full_decode_frames != 0;
+      if (full_decode) {
+	full_decode_frames--;
+      }
+      if (last_frame_from_screen) {
+	// everything below can change `screen`
+	wait_for_display(false);
+      }
+      uint32_t base = (stream_base + stream_size + BAND_SIZE - 1) & ~(BAND_SIZE - 1);
+      ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+      ZSTD_inBuffer in = {
+	frame_ring_payload(&compressed_frames, slot), header->payload_size, 0
+      };
+      compressed_size = header->payload_size;
+      bool decompressed = true;
+      bool dropped = false;
+      bool started = false;
+      // the display got within a band of decompression, and maybe
+      // past it
+      bool close_call = false;
+      bool late = false;
+      uint32_t decode_us = 0;
+      for (uint32_t offset = 0; offset < expected_size; offset += BAND_SIZE) {
+	uint32_t size = MIN(BAND_SIZE, expected_size - offset);
+	uint8_t* band = &row_ring[(base + offset) % ROW_RING_SIZE];
+	// back-pressure: don't write over anything the display hasn't
+	// read yet, from this frame or the last one
+	while (!last_frame_from_screen &&
+	       (int32_t)(base + offset + size -
+			 (stream_base + stream_consumed(last_frame_partial, stream_size))) > ROW_RING_SIZE);
+	// the last copy into screen might still be reading this part of
+	// the ring
+	wait_for_screen_copy();
+
+	if (decompressed) {
+	  uint32_t decode_start = time_us_32();
+	  decompressed = decompress_band(dctx, &in, band, size);
+	  decode_us += time_us_32() - decode_start;
+	}
+	if (!decompressed && offset == 0) {
+	  // nothing's changed yet, so just drop it
+	  dropped = true;
+	  break;
+	}
+	// if the frame turns out to be bad partway through, the rest of
+	// it is what's already there, so the screen still matches
+	// `screen`
+	process_band(header, offset, band, size, decompressed);
+	if (started) {
+	  // the display can't wait for us (GCK and GEN keep going once a
+	  // frame starts, so stalling the data would put rows on the
+	  // wrong lines), so all we can do is notice
+	  uint32_t consumed = stream_consumed(partial, expected_size);
+	  if (consumed + BAND_SIZE > offset) {
+	    close_call = true;
+	  }
+	  if (consumed > offset) {
+	    late = true;
+	    late_bands++;
+	  }
+	}
+
+	if (!started && !full_decode &&
+	    (offset + size >= PREFILL_SIZE || offset + size == expected_size)) {
+	  start_display(header, &row_ring[base % ROW_RING_SIZE], expected_size, last_frame_partial);
+	  stream_base = base;
+	  stream_size = expected_size;
+	  last_frame_partial = partial;
+	  last_frame_from_screen = false;
+	  started = true;
+	}
+      }
+      last_decode_us = decode_us;
+
+      if (close_call) {
+	full_decode_frames = FULL_DECODE_FRAMES;
+      }
+      // a frame that was decompressed in full goes out now, and so does
+      // one that the display got ahead of, since some of its rows went
+      // out before they were there. either way, `screen` has the whole
+      // thing. a partial frame goes out as a full one this way.
+      if ((full_decode && !dropped) || late) {
+	start_display(header, NULL, 0, last_frame_partial);
+	stream_base = base;
+	stream_size = expected_size;
+	last_frame_partial = false;
+	last_frame_from_screen = true;
       }
-      
       uint32_t c = DWT->CYCCNT;
-      // if we get a really short frame, the decompression time is so
-      // low that we end up resetting the PIO during a frame, and the
-      // screen goes dark. if we instead always make sure that the PIO
-      // is done before resetting it, then the screen always holds the
-      // correct frame.
-      while (dma_channel_is_busy(image_pixels_channel) ||
-	     dma_channel_is_busy(image_pixels_zero_channel));
-      // after the DMA ends, we have five GCK h/ls to wait for. add
-      // one more for good measure
-      sleep_us(one_gck_hl_us*6);
-      reset_full_frame_pio();
-      send_full_frame_image(framebuffer);
+      // we're done with the compressed data, so core0 can have its
+      // space back
+      frame_ring_release(&compressed_frames);
+      frames_decoded++;
 
       /*sprintf(str, "frame %lu: decompression time for %lu bytes=>%lu bytes: %f\r\n",
-	      count, compressed_size, dsize, ((float)c/200e6));
+	      count, compressed_size, expected_size, ((float)c/200e6));
       uart_puts(uart1, str);*/
       //count++;
       //multicore_doorbell_clear_other_core(data_processing_doorbell);
@@ -256,9 +849,7 @@ void main() {
   DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 
   // init multicore
-  data_ready_doorbell = multicore_doorbell_claim_unused((1 << NUM_CORES) - 1, true);
-  multicore_doorbell_clear_current_core(data_ready_doorbell);
-  
+  frame_ring_init(&compressed_frames, compressed_data, sizeof(compressed_data));
   multicore_launch_core1(core1_entry);
   
   // init display stuff
@@ -315,8 +906,20 @@ void main() {
   bool frame_in_progress = false;
   uint32_t count = 0;
   uint32_t compressed_size = 0;
+  frame_header_t header;
+  // where the payload of the message coming in goes, once we know what
+  // it is. NULL means it's no good, and gets read into `discard` and
+  // thrown away.
+  uint8_t* payload = NULL;
+  bool discarding = false;
+  uint8_t discard[64];
+  uint32_t reported_frames = 0;
+  bool report_due = false;
+  // a dictionary came in, and core1 hasn't loaded it yet
+  bool dictionary_waiting = false;
   
   init_full_frame_pio();
+  init_partial_update_pios();
   image_pixels_channel = dma_claim_unused_channel(true); // true -> required
   if (image_pixels_channel < 0) {
     printf("failed to claim red dma channel\n");
@@ -329,9 +932,21 @@ void main() {
     error_handler();
   }
 
-  compressed_data_copy_channel = dma_claim_unused_channel(true);
-  if (compressed_data_copy_channel < 0) {
-    printf("failed to claim compressed data copy channel\n");
+  screen_copy_channel = dma_claim_unused_channel(true);
+  if (screen_copy_channel < 0) {
+    printf("failed to claim screen copy dma channel\n");
+    error_handler();
+  }
+
+  gck_control_channel = dma_claim_unused_channel(true);
+  if (gck_control_channel < 0) {
+    printf("failed to claim GCK control dma channel\n");
+    error_handler();
+  }
+
+  partial_data_channel = dma_claim_unused_channel(true);
+  if (partial_data_channel < 0) {
+    printf("failed to claim partial pixel data dma channel\n");
     error_handler();
   }
 
@@ -350,6 +965,32 @@ void main() {
       continue;
     }
 
+    // core1 loads a new dictionary once it's done with every frame
+    // before it. until then, whatever comes after the dictionary waits
+    // in the USB FIFO, so the next frame can't get decompressed without
+    // it, and we don't report on frames from before it.
+    if (dictionary_waiting) {
+      if (dictionary_pending) {
+	continue;
+      }
+      dictionary_waiting = false;
+      // the frame counts start over (core1 does frames_decoded), and
+      // we let the host know we're ready for frames
+      frames_received = 0;
+      frames_discarded = 0;
+      reported_frames = 0;
+      report_due = true;
+    }
+
+    // tell the host every time core1 frees up a buffer
+    uint32_t decoded = frames_decoded;
+    if ((report_due || decoded != reported_frames) &&
+	tud_vendor_write_available() >= sizeof(status_report_t)) {
+      send_status_report();
+      reported_frames = decoded;
+      report_due = false;
+    }
+
     uint32_t avail = tud_vendor_available();
     
     if (avail != 0) {
@@ -357,42 +998,77 @@ void main() {
       if (!frame_in_progress) {
 	frame_in_progress = true;
 	DWT->CYCCNT = 0;
-	// read initial 4 byte size value
 	compressed_size = 0;
 	count = 0;
-	// start by reading just the number of bytes in this compressed frame
-	count += tud_vendor_read(inputbuf, 4);
-	memcpy(&compressed_size, inputbuf, 4);
+      }
+
+      if (count < sizeof(frame_header_t)) {
+	// start by reading just the header, which has the number of
+	// bytes in this compressed frame and which rows they're for
+	count += tud_vendor_read((uint8_t*)&header + count, sizeof(frame_header_t) - count);
+	if (count < sizeof(frame_header_t)) {
+	  continue;
+	}
+	compressed_size = header.payload_size;
 	/*sprintf(str, "going to read %lu bytes\r\n", compressed_size);
 	uart_puts(uart1, str);*/
+
+	// the payload goes straight where it's used, with no copy after.
+	// dictionaries go where core1 loads them from, which it's done
+	// with until we set dictionary_pending, and frames go in the
+	// frame ring.
+	payload = NULL;
+	if (header.payload_type == PAYLOAD_DICTIONARY) {
+	  discarding = compressed_size > MAX_DICTIONARY_SIZE;
+	  if (!discarding) {
+	    payload = dictionary_buffer;
+	  }
+	} else {
+	  discarding = compressed_size > BUFSIZE;
+	}
       }
 
-      // then try to read as many as we can get
-      count += tud_vendor_read(inputbuf + count, compressed_size);
-      if (count == compressed_size + 4) {
+      if (payload == NULL && !discarding) {
+	// wait for room in the ring if core1 is behind. the host's flow
+	// control doesn't send more frames than the ring has slots, so
+	// this only waits when the frames are big, and then the data
+	// just waits in the USB FIFO.
+	payload = frame_ring_reserve(&compressed_frames, compressed_size);
+	if (payload == NULL) {
+	  continue;
+	}
+      }
+
+      // then try to read as many as we can get (but not past the end
+      // of this frame)
+      uint32_t payload_count = count - sizeof(frame_header_t);
+      if (payload != NULL) {
+	count += tud_vendor_read(payload + payload_count, compressed_size - payload_count);
+      } else {
+	uint32_t left = compressed_size - payload_count;
+	count += tud_vendor_read(discard, left < sizeof(discard) ? left : sizeof(discard));
+      }
+      if (count == compressed_size + sizeof(frame_header_t)) {
 
 	uint32_t end = DWT->CYCCNT;
 
-	// this loop can always be at most one frame ahead of the
-	// decompression loop
-	
-	if (newest_compressed_buffer == 0) {
-	  // if we last wrote to 0, use 1
-	  //
-	  // note that we don't need to copy the count bytes.
-	  //
-	  // using DMA here would probably save about 20000 cycles,
-	  // for maybe a .1-.2 difference in fps
-	  memcpy(compressed_buffer1.data, &inputbuf[4], compressed_size);
-	  compressed_buffer1.compressed_size = compressed_size;
-	  newest_compressed_buffer = 1;
-	  multicore_doorbell_set_other_core(data_ready_doorbell);
-	  
-	} else if (newest_compressed_buffer == 1) {
-	  memcpy(compressed_buffer0.data, &inputbuf[4], compressed_size);
-	  compressed_buffer0.compressed_size = compressed_size;
-	  newest_compressed_buffer = 0;
-	  multicore_doorbell_set_other_core(data_ready_doorbell);
+	if (discarding) {
+	  // the host counts every frame it sends against the frame ring
+	  // until we say it's done, so one we throw out has to count as
+	  // done too, or the host never gets that slot back
+	  if (header.payload_type != PAYLOAD_DICTIONARY) {
+	    frames_received++;
+	    frames_discarded++;
+	    report_due = true;
+	  }
+	} else if (header.payload_type == PAYLOAD_DICTIONARY) {
+	  dictionary_size = compressed_size;
+	  dictionary_pending = true;
+	  dictionary_waiting = true;
+	} else {
+	  // count it first, so frames_decoded never gets ahead
+	  frames_received++;
+	  frame_ring_commit(&compressed_frames, &header);
 	}
 	
 	uint32_t after_decomp = DWT->CYCCNT;
@@ -0,0 +1,207 @@
+// tests for the frame ring, which build and run on the computer
+// instead of the RP2350 (see the top of CMakeLists.txt). the first few
+// go one step at a time from one thread, and the last one runs a
+// producer and a consumer against each other like core0 and core1.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_ring.h"
+
+static int failures = 0;
+
+#define CHECK(condition) do {						\
+    if (!(condition)) {							\
+      printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #condition);	\
+      failures++;							\
+    }									\
+  } while (0)
+
+static frame_header_t header_for(uint32_t size, uint16_t tag) {
+  frame_header_t header = {0};
+  header.payload_size = size;
+  header.payload_type = PAYLOAD_FRAME;
+  // nothing reads the ranges here, so this is a handy place to number
+  // the frames
+  header.range_count = tag;
+  return header;
+}
+
+// reserve `size` bytes, fill them with `tag`, and commit. NULL if
+// there wasn't room.
+static uint8_t* push(frame_ring_t* ring, uint32_t size, uint16_t tag) {
+  uint8_t* payload = frame_ring_reserve(ring, size);
+  if (payload != NULL) {
+    memset(payload, (uint8_t)tag, size);
+    frame_header_t header = header_for(size, tag);
+    frame_ring_commit(ring, &header);
+  }
+  return payload;
+}
+
+// check that the oldest frame is `tag` and `size` bytes of it, then
+// release it
+static void pop(frame_ring_t* ring, uint32_t size, uint16_t tag) {
+  const frame_ring_slot_t* slot = frame_ring_peek(ring);
+  CHECK(slot != NULL);
+  if (slot == NULL) {
+    return;
+  }
+  CHECK(slot->header.range_count == tag);
+  CHECK(slot->header.payload_size == size);
+  const uint8_t* payload = frame_ring_payload(ring, slot);
+  for (uint32_t i = 0; i < size; i++) {
+    if (payload[i] != (uint8_t)tag) {
+      CHECK(payload[i] == (uint8_t)tag);
+      break;
+    }
+  }
+  frame_ring_release(ring);
+}
+
+static void test_wraparound() {
+  uint8_t data[100];
+  frame_ring_t ring;
+  frame_ring_init(&ring, data, sizeof(data));
+
+  CHECK(push(&ring, 40, 1) == &data[0]);
+  CHECK(push(&ring, 40, 2) == &data[40]);
+  pop(&ring, 40, 1);
+  // 20 bytes left at the end isn't enough, so this starts over at the
+  // beginning, where frame 1 was
+  CHECK(push(&ring, 30, 3) == &data[0]);
+  // and now only the 10 bytes between frames 3 and 2 are free
+  CHECK(push(&ring, 20, 4) == NULL);
+  CHECK(push(&ring, 9, 4) == &data[30]);
+  CHECK(frame_ring_count(&ring) == 3);
+  pop(&ring, 40, 2);
+  pop(&ring, 30, 3);
+  pop(&ring, 9, 4);
+  CHECK(frame_ring_peek(&ring) == NULL);
+  // empty, so everything's free again
+  CHECK(push(&ring, 100, 5) == &data[0]);
+  pop(&ring, 100, 5);
+}
+
+static void test_full() {
+  uint8_t data[1000];
+  frame_ring_t ring;
+  frame_ring_init(&ring, data, sizeof(data));
+
+  // out of slots, with plenty of bytes left
+  for (uint16_t i = 0; i < FRAME_RING_SLOTS; i++) {
+    CHECK(push(&ring, 10, i) != NULL);
+  }
+  CHECK(frame_ring_count(&ring) == FRAME_RING_SLOTS);
+  CHECK(push(&ring, 10, 99) == NULL);
+  pop(&ring, 10, 0);
+  CHECK(push(&ring, 10, FRAME_RING_SLOTS) != NULL);
+  for (uint16_t i = 1; i <= FRAME_RING_SLOTS; i++) {
+    pop(&ring, 10, i);
+  }
+
+  // out of bytes, with slots left
+  CHECK(push(&ring, 600, 1) != NULL);
+  CHECK(push(&ring, 600, 2) == NULL);
+  // bigger than the whole ring never fits
+  pop(&ring, 600, 1);
+  CHECK(push(&ring, 1001, 3) == NULL);
+
+  // empty frames take a slot, but no bytes
+  CHECK(push(&ring, 1000, 4) == &data[0]);
+  CHECK(push(&ring, 0, 5) != NULL);
+  pop(&ring, 1000, 4);
+  pop(&ring, 0, 5);
+}
+
+static void test_overruns() {
+  uint8_t data[100];
+  frame_ring_t ring;
+  frame_ring_init(&ring, data, sizeof(data));
+
+  CHECK(push(&ring, 80, 1) != NULL);
+  // a frame that has to wait counts once, however many times the
+  // producer tries
+  CHECK(push(&ring, 50, 2) == NULL);
+  CHECK(push(&ring, 50, 2) == NULL);
+  CHECK(push(&ring, 50, 2) == NULL);
+  CHECK(atomic_load(&ring.overruns) == 1);
+  pop(&ring, 80, 1);
+  CHECK(push(&ring, 50, 2) != NULL);
+  CHECK(atomic_load(&ring.overruns) == 1);
+
+  // and the next one that has to wait counts again
+  CHECK(push(&ring, 80, 3) == NULL);
+  CHECK(atomic_load(&ring.overruns) == 2);
+  pop(&ring, 50, 2);
+  CHECK(push(&ring, 80, 3) != NULL);
+  CHECK(atomic_load(&ring.overruns) == 2);
+}
+
+#define STRESS_CAPACITY (1000)
+#define STRESS_FRAMES (100000)
+
+static uint8_t stress_data[STRESS_CAPACITY];
+static frame_ring_t stress_ring;
+
+static void* stress_consumer(void* unused) {
+  (void)unused;
+  for (uint32_t frame = 0; frame < STRESS_FRAMES; ) {
+    const frame_ring_slot_t* slot = frame_ring_peek(&stress_ring);
+    if (slot == NULL) {
+      sched_yield();
+      continue;
+    }
+    // every byte is its frame number plus where it is in the frame,
+    // so frames that come out of order or get written over show up
+    const uint8_t* payload = frame_ring_payload(&stress_ring, slot);
+    CHECK(slot->header.range_count == (uint16_t)frame);
+    for (uint32_t i = 0; i < slot->header.payload_size; i++) {
+      if (payload[i] != (uint8_t)(frame + i)) {
+	CHECK(payload[i] == (uint8_t)(frame + i));
+	break;
+      }
+    }
+    frame_ring_release(&stress_ring);
+    frame++;
+  }
+  return NULL;
+}
+
+static void test_two_threads() {
+  frame_ring_init(&stress_ring, stress_data, sizeof(stress_data));
+  pthread_t consumer;
+  pthread_create(&consumer, NULL, stress_consumer, NULL);
+
+  srand(1);
+  for (uint32_t frame = 0; frame < STRESS_FRAMES; frame++) {
+    uint32_t size = rand() % 400;
+    uint8_t* payload;
+    while ((payload = frame_ring_reserve(&stress_ring, size)) == NULL) {
+      sched_yield();
+    }
+    for (uint32_t i = 0; i < size; i++) {
+      payload[i] = (uint8_t)(frame + i);
+    }
+    frame_header_t header = header_for(size, (uint16_t)frame);
+    frame_ring_commit(&stress_ring, &header);
+  }
+  pthread_join(consumer, NULL);
+  CHECK(frame_ring_count(&stress_ring) == 0);
+}
+
+int main() {
+  test_wraparound();
+  test_full();
+  test_overruns();
+  test_two_threads();
+  if (failures != 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all frame ring tests passed\n");
+  return 0;
+}
@@ -0,0 +1,150 @@
+// Benchmarks for the per-frame kernels: dithering, formatting (and
+// unformatting), and zstd at a few compression levels, all run on the
+// same images sharpie-formatter uses for testing. The dither and
+// format kernels are sharpie-core's, which the formatter uses too, so
+// these cover both tools.
+//
+// zstd gets set up the way the encoder does it. To bench it with a
+// dictionary from --train-dictionary, point SHARPIE_BENCH_DICTIONARY at
+// it.
+//
+// Criterion keeps the results of the last run in target/criterion and
+// tells you what changed, but to compare against a known-good
+// version, save a baseline first:
+//
+//   cargo bench -- --save-baseline before
+//   (make changes)
+//   cargo bench -- --baseline before
+//
+// target/criterion/report/index.html has the whole comparison.
+
+use std::env;
+use std::hint::black_box;
+use std::path::PathBuf;
+use std::sync::LazyLock;
+use std::thread;
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+use sharpie_core::dither::Ditherer;
+use sharpie_core::format::{self, FRAMESIZE};
+use sharpie_usb_display_host::{dictionary, encoder};
+
+/// Test images, relative to sharpie-formatter. They all have to be
+/// 240x320 already.
+const CORPUS: &[(&str, &str)] = &[
+    ("pencils", "pencils.jpg"),
+    ("the_gang", "the_gang/the_gang_resized_rotated.png"),
+];
+
+/// The rate controller picks a level between 1 and 12 for each frame,
+/// starting at 6 (see rate.rs). 19 is there to show what's left past
+/// the top of that range.
+const ZSTD_LEVELS: &[i32] = &[1, 3, 6, 9, 12, 19];
+
+/// A corpus image at every step of the pipeline.
+struct Frame {
+    name: &'static str,
+    /// packed RGB8
+    rgb: Vec<u8>,
+    /// dithered, one 0bBBGGRR pixel per byte
+    pixels_6bpp: Vec<u8>,
+    formatted: Vec<u8>,
+}
+
+static CORPUS_FRAMES: LazyLock<Vec<Frame>> = LazyLock::new(|| {
+    let dir = PathBuf::from(env!("CARGO_MANIFEST_DIR")).join("../../sharpie-formatter");
+    CORPUS.iter().map(|&(name, path)| {
+        let img = image::open(dir.join(path))
+            .unwrap_or_else(|e| panic!("failed to open {}: {}", path, e))
+            .to_rgb8();
+        assert_eq!(img.dimensions(), (240, 320), "{} isn't 240x320", path);
+        let rgb = img.into_raw();
+
+        let mut pixels_6bpp = vec![0u8; FRAMESIZE];
+        Ditherer::new(240, 1).dither_to_6bpp(&rgb, 3, &mut pixels_6bpp);
+        let mut formatted = vec![0u8; FRAMESIZE];
+        format::format_image(&pixels_6bpp, &mut formatted);
+
+        Frame { name, rgb, pixels_6bpp, formatted }
+    }).collect()
+});
+
+fn max_dither_threads() -> usize {
+    // same default as the host's --dither-threads
+    thread::available_parallelism().map_or(1, |n| n.get().min(4))
+}
+
+fn dither(c: &mut Criterion) {
+    let mut group = c.benchmark_group("dither");
+    group.throughput(Throughput::Elements(FRAMESIZE as u64));
+    let mut threads = vec![1];
+    if max_dither_threads() > 1 {
+        threads.push(max_dither_threads());
+    }
+    for frame in CORPUS_FRAMES.iter() {
+        let mut out = vec![0u8; FRAMESIZE];
+        for &threads in &threads {
+            let mut ditherer = Ditherer::new(240, threads);
+            group.bench_with_input(
+                BenchmarkId::new(format!("to_6bpp/{}t", threads), frame.name), &frame.rgb,
+                |b, rgb| b.iter(|| ditherer.dither_to_6bpp(black_box(rgb), 3, &mut out)));
+            group.bench_with_input(
+                BenchmarkId::new(format!("to_sharpie/{}t", threads), frame.name), &frame.rgb,
+                |b, rgb| b.iter(|| ditherer.dither_to_sharpie(black_box(rgb), 3, &mut out)));
+        }
+    }
+    group.finish();
+}
+
+fn format(c: &mut Criterion) {
+    let mut group = c.benchmark_group("format");
+    group.throughput(Throughput::Elements(FRAMESIZE as u64));
+    for frame in CORPUS_FRAMES.iter() {
+        let mut out = vec![0u8; FRAMESIZE];
+        group.bench_with_input(BenchmarkId::new("format_image", frame.name), &frame.pixels_6bpp,
+                               |b, pixels| b.iter(|| format::format_image(black_box(pixels), &mut out)));
+        // a whole frame's worth of pixel pairs, which is what
+        // format_image spends nearly all its time on
+        group.bench_with_input(
+            BenchmarkId::new("two_pixels_to_msb_lsb", frame.name), &frame.pixels_6bpp,
+            |b, pixels| b.iter(|| {
+                for (pair, bytes) in pixels.chunks_exact(2).zip(out.chunks_exact_mut(2)) {
+                    let (msb, lsb) = format::two_pixels_to_msb_lsb(black_box(pair[0]),
+                                                                   black_box(pair[1]));
+                    bytes[0] = msb;
+                    bytes[1] = lsb;
+                }
+            }));
+        group.bench_with_input(BenchmarkId::new("unformat_image", frame.name), &frame.formatted,
+                               |b, formatted| b.iter(|| format::unformat_image(black_box(formatted), &mut out)));
+    }
+    group.finish();
+}
+
+fn compress(c: &mut Criterion) {
+    let mut group = c.benchmark_group("zstd");
+    group.throughput(Throughput::Bytes(FRAMESIZE as u64));
+    // the high levels take long enough that the default 100 samples
+    // drag on forever
+    group.sample_size(20);
+    let dictionary = env::var_os("SHARPIE_BENCH_DICTIONARY").map(|path| {
+        dictionary::load(path.as_ref())
+            .unwrap_or_else(|e| panic!("failed to load dictionary {:?}: {}", path, e))
+    });
+    for frame in CORPUS_FRAMES.iter() {
+        for &level in ZSTD_LEVELS {
+            let mut compressor = encoder::new_compressor(level, dictionary.as_deref());
+            // time is only half of it, so say how big it came out
+            println!("zstd/{}/{}: {} bytes", level, frame.name,
+                     compressor.compress(&frame.formatted).unwrap().len());
+            group.bench_with_input(BenchmarkId::new(format!("compress/{}", level), frame.name),
+                                   &frame.formatted,
+                                   |b, formatted| b.iter(|| compressor.compress(black_box(formatted)).unwrap()));
+        }
+    }
+    group.finish();
+}
+
+criterion_group!(benches, dither, format, compress);
+criterion_main!(benches);
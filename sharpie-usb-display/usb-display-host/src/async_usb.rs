@@ -0,0 +1,278 @@
+// Asynchronous USB writes. A blocking write_bulk hands libusb one
+// frame, waits for the last packet of it to go out, and only then
+// returns, so the bus sits idle from the end of one frame until the
+// usb stage gets around to writing the next one. Here, frames get cut
+// into chunks that go out as libusb asynchronous transfers, with
+// several in flight at once, so the host controller always has the
+// next chunk queued and the link stays busy from one frame straight
+// into the next. A write only blocks when every transfer is in flight.
+// That makes timing writes useless for seeing how busy the link is, so
+// the completion callback keeps track of when each write actually
+// finished going out (see take_write_times).
+//
+// Transfers on the same endpoint complete in the order they were
+// submitted, and Sharpie reads a byte stream anyway, so it doesn't
+// notice the chunks.
+//
+// rusb doesn't wrap libusb's asynchronous API, so this goes through
+// its raw bindings.
+
+use std::os::raw::{c_int, c_uint, c_void};
+use std::ptr;
+use std::sync::{Arc, Condvar, Mutex};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+use rusb::{self, ffi, UsbContext};
+use rusb::ffi::constants::*;
+
+use crate::transport::{Transport, SHARPIE_EP_OUT};
+
+/// Bytes per transfer. A multiple of the 64-byte packet size, and
+/// small enough that a few of them cover a frame.
+const CHUNK_SIZE: usize = 16 * 1024;
+
+/// Transfers that can be in flight at once. 64 KB covers any frame,
+/// and then some.
+const TRANSFERS: usize = 4;
+
+/// How long libusb gets to finish a single transfer.
+const TRANSFER_TIMEOUT: Duration = Duration::from_millis(1000);
+
+/// How long the event thread waits for events before checking if it
+/// should stop.
+const EVENT_TIMEOUT: Duration = Duration::from_millis(100);
+
+/// Write times to hold on to when nobody's taking them. Way more than
+/// the encoder lets pile up between reports.
+const MAX_WRITE_TIMES: usize = 1024;
+
+struct State {
+    /// transfers that aren't in flight
+    free: Vec<usize>,
+    /// the first transfer to fail since the last write, which the next
+    /// write returns
+    error: Option<rusb::Error>,
+    /// when the last write finished going out
+    last_write_done: Option<Instant>,
+    /// how long the writes that finished since the last
+    /// take_write_times() spent going out
+    write_times: Vec<Duration>,
+}
+
+/// What the completion callback needs, shared with the writer.
+struct Shared {
+    state: Mutex<State>,
+    /// signalled every time a transfer completes
+    completed: Condvar,
+}
+
+/// A transfer and its buffer. `user_data` points at one of these, so
+/// they're boxed and never move.
+struct Slot {
+    transfer: *mut ffi::libusb_transfer,
+    buffer: Vec<u8>,
+    index: usize,
+    /// when the write this transfer is the last chunk of started, if
+    /// it's the last chunk of one
+    write_started: Option<Instant>,
+    shared: Arc<Shared>,
+}
+
+/// Sharpie's USB interface, with writes done as asynchronous
+/// transfers. Reads (for status reports) are still plain blocking
+/// ones.
+pub struct AsyncUsb {
+    handle: rusb::DeviceHandle<rusb::GlobalContext>,
+    shared: Arc<Shared>,
+    slots: Mutex<Vec<Box<Slot>>>,
+    stop: Arc<AtomicBool>,
+    events: Option<JoinHandle<()>>,
+}
+
+// the raw transfers are only touched while holding `slots` (to fill
+// and submit them) or from the completion callback once libusb is
+// done with them, so sharing them between threads is fine
+unsafe impl Send for AsyncUsb {}
+unsafe impl Sync for AsyncUsb {}
+
+/// Runs on the event thread when a transfer finishes.
+extern "system" fn transfer_completed(transfer: *mut ffi::libusb_transfer) {
+    // safe because user_data is the transfer's slot, which outlives
+    // every transfer that's in flight
+    let (slot, status, short) = unsafe {
+        let transfer = &*transfer;
+        (&*(transfer.user_data as *const Slot), transfer.status,
+         transfer.actual_length < transfer.length)
+    };
+    let now = Instant::now();
+    let mut state = slot.shared.state.lock().unwrap();
+    if let Some(started) = slot.write_started {
+        // transfers finish in order, so until the write before this one
+        // was done, this one was only waiting on it
+        let started = state.last_write_done.map_or(started, |done| done.max(started));
+        if state.write_times.len() < MAX_WRITE_TIMES {
+            state.write_times.push(now - started);
+        }
+        state.last_write_done = Some(now);
+    }
+    if state.error.is_none() {
+        state.error = match status {
+            LIBUSB_TRANSFER_COMPLETED if short => Some(rusb::Error::Io),
+            LIBUSB_TRANSFER_COMPLETED => None,
+            LIBUSB_TRANSFER_TIMED_OUT => Some(rusb::Error::Timeout),
+            LIBUSB_TRANSFER_STALL => Some(rusb::Error::Pipe),
+            LIBUSB_TRANSFER_NO_DEVICE => Some(rusb::Error::NoDevice),
+            LIBUSB_TRANSFER_OVERFLOW => Some(rusb::Error::Overflow),
+            LIBUSB_TRANSFER_CANCELLED => Some(rusb::Error::Interrupted),
+            _ => Some(rusb::Error::Io),
+        };
+    }
+    state.free.push(slot.index);
+    slot.shared.completed.notify_all();
+}
+
+impl AsyncUsb {
+    pub fn new(handle: rusb::DeviceHandle<rusb::GlobalContext>) -> rusb::Result<AsyncUsb> {
+        let shared = Arc::new(Shared {
+            state: Mutex::new(State {
+                free: (0..TRANSFERS).collect(),
+                error: None,
+                last_write_done: None,
+                write_times: Vec::new(),
+            }),
+            completed: Condvar::new(),
+        });
+        let mut slots = Vec::with_capacity(TRANSFERS);
+        for index in 0..TRANSFERS {
+            let transfer = unsafe { ffi::libusb_alloc_transfer(0) };
+            if transfer.is_null() {
+                return Err(rusb::Error::NoMem);
+            }
+            slots.push(Box::new(Slot {
+                transfer,
+                buffer: vec![0u8; CHUNK_SIZE],
+                index,
+                write_started: None,
+                shared: shared.clone(),
+            }));
+        }
+
+        // somebody has to run libusb's event loop for callbacks to
+        // happen
+        let stop = Arc::new(AtomicBool::new(false));
+        let events_stop = stop.clone();
+        let events = thread::spawn(move || {
+            while !events_stop.load(Ordering::Relaxed) {
+                if let Err(e) = rusb::GlobalContext::default().handle_events(Some(EVENT_TIMEOUT)) {
+                    println!("USB event handling failed: {}", e);
+                    break;
+                }
+            }
+        });
+
+        Ok(AsyncUsb {
+            handle,
+            shared,
+            slots: Mutex::new(slots),
+            stop,
+            events: Some(events),
+        })
+    }
+
+    /// Wait until `ready` says the transfers are where we need them,
+    /// or `timeout` runs out.
+    fn wait_for<'a>(&'a self, timeout: Duration, ready: impl Fn(&State) -> bool)
+                    -> rusb::Result<std::sync::MutexGuard<'a, State>> {
+        let deadline = Instant::now() + timeout;
+        let mut state = self.shared.state.lock().unwrap();
+        while !ready(&state) {
+            if let Some(error) = state.error.take() {
+                return Err(error);
+            }
+            let left = deadline.checked_duration_since(Instant::now())
+                .ok_or(rusb::Error::Timeout)?;
+            state = self.shared.completed.wait_timeout(state, left).unwrap().0;
+        }
+        if let Some(error) = state.error.take() {
+            return Err(error);
+        }
+        Ok(state)
+    }
+
+    /// Wait for everything that's in flight to finish.
+    pub fn flush(&self, timeout: Duration) -> rusb::Result<()> {
+        self.wait_for(timeout, |state| state.free.len() == TRANSFERS).map(|_| ())
+    }
+}
+
+impl Transport for AsyncUsb {
+    /// Queue `data` up to go out, and return once it's all been
+    /// submitted (not sent). Errors from earlier writes show up here.
+    fn write(&self, data: &[u8], timeout: Duration) -> rusb::Result<usize> {
+        let started = Instant::now();
+        let mut slots = self.slots.lock().unwrap();
+        let chunks = data.chunks(CHUNK_SIZE).count();
+        for (i, chunk) in data.chunks(CHUNK_SIZE).enumerate() {
+            let index = self.wait_for(timeout, |state| !state.free.is_empty())?
+                .free.pop().unwrap();
+            let slot = &mut slots[index];
+            slot.buffer[..chunk.len()].copy_from_slice(chunk);
+            slot.write_started = (i == chunks - 1).then_some(started);
+            let result = unsafe {
+                ffi::libusb_fill_bulk_transfer(
+                    slot.transfer, self.handle.as_raw(), SHARPIE_EP_OUT,
+                    slot.buffer.as_mut_ptr(), chunk.len() as c_int,
+                    transfer_completed, &**slot as *const Slot as *mut c_void,
+                    TRANSFER_TIMEOUT.as_millis() as c_uint);
+                ffi::libusb_submit_transfer(slot.transfer)
+            };
+            if result != LIBUSB_SUCCESS {
+                self.shared.state.lock().unwrap().free.push(index);
+                return Err(if result == LIBUSB_ERROR_NO_DEVICE {
+                    rusb::Error::NoDevice
+                } else {
+                    rusb::Error::Io
+                });
+            }
+        }
+        Ok(data.len())
+    }
+
+    /// Errors from writes show up here too (and stay for the next
+    /// write). Once a transfer fails, Sharpie never sees that frame,
+    /// so it never reports it decoded, and the encoder could sit
+    /// waiting on credits forever without writing again to find out.
+    fn read(&self, buf: &mut [u8], timeout: Duration) -> rusb::Result<usize> {
+        if let Some(error) = self.shared.state.lock().unwrap().error {
+            return Err(error);
+        }
+        self.handle.read(buf, timeout)
+    }
+
+    fn take_write_times(&self) -> Option<Vec<Duration>> {
+        Some(std::mem::take(&mut self.shared.state.lock().unwrap().write_times))
+    }
+}
+
+impl Drop for AsyncUsb {
+    fn drop(&mut self) {
+        // let whatever's in flight finish (or give up on it), since
+        // libusb still owns those transfers
+        if self.flush(TRANSFER_TIMEOUT * 2).is_err() {
+            for slot in self.slots.lock().unwrap().iter() {
+                unsafe { ffi::libusb_cancel_transfer(slot.transfer); }
+            }
+            let _ = self.flush(TRANSFER_TIMEOUT);
+        }
+        self.stop.store(true, Ordering::Relaxed);
+        if let Some(events) = self.events.take() {
+            let _ = events.join();
+        }
+        for slot in self.slots.lock().unwrap().iter_mut() {
+            unsafe { ffi::libusb_free_transfer(slot.transfer); }
+            slot.transfer = ptr::null_mut();
+        }
+    }
+}
@@ -0,0 +1,108 @@
+// Sharpie video containers, made by sharpie-formatter's
+// encode-container. A container holds every frame of a video already
+// dithered, formatted, compressed, and wrapped in its message header,
+// so playing one (see playback.rs) is just reading frames out of the
+// file and writing them to Sharpie. The file gets memory mapped, so
+// that doesn't even copy them.
+//
+// The layout is
+//
+//   8 bytes  magic, "SHARPIEV"
+//   u32      version (2)
+//   u32      frame count
+//   u32      framerate the frames were taken at
+//   u32      dictionary size
+//   u64      index offset
+//   the dictionary (see dictionary.rs), which can be empty
+//   every frame, as a full frame message (see protocol.rs)
+//   the index: a u64 file offset for every frame's message
+//
+// all little-endian. Every frame is a full frame, so playback can
+// start or jump anywhere. Version 1 was the same, but its frames could
+// have zstd windows too big for the client (see MAX_WINDOW_LOG in
+// protocol.rs).
+
+use std::fs::File;
+use std::io;
+use std::ops::Range;
+use std::path::Path;
+
+use memmap2::Mmap;
+
+use crate::protocol::{HEADER_SIZE, MAX_DICTIONARY_SIZE};
+
+const MAGIC: &[u8; 8] = b"SHARPIEV";
+const VERSION: u32 = 2;
+const CONTAINER_HEADER_SIZE: usize = 32;
+
+pub struct Container {
+    map: Mmap,
+    pub framerate: u32,
+    dictionary: Range<usize>,
+    /// where every frame's message is in `map`
+    frames: Vec<Range<usize>>,
+}
+
+fn invalid(message: String) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, message)
+}
+
+impl Container {
+    pub fn open(path: &Path) -> io::Result<Container> {
+        let file = File::open(path)?;
+        // safe as long as nobody changes the file while we're playing
+        // it, which is about as much as any player can promise
+        let map = unsafe { Mmap::map(&file)? };
+
+        if map.len() < CONTAINER_HEADER_SIZE || &map[0..8] != MAGIC {
+            return Err(invalid(format!("{:?} isn't a Sharpie video container", path)));
+        }
+        let u32_at = |i: usize| u32::from_le_bytes(map[i..i + 4].try_into().unwrap());
+        let version = u32_at(8);
+        if version != VERSION {
+            return Err(invalid(format!("container version {} isn't supported", version)));
+        }
+        let frame_count = u32_at(12) as usize;
+        let framerate = u32_at(16);
+        let dictionary_size = u32_at(20) as usize;
+        let index_offset = u64::from_le_bytes(map[24..32].try_into().unwrap()) as usize;
+        if dictionary_size > MAX_DICTIONARY_SIZE {
+            return Err(invalid(format!("container has a {} byte dictionary, but Sharpie \
+                                        only has room for {}",
+                                       dictionary_size, MAX_DICTIONARY_SIZE)));
+        }
+        let dictionary = CONTAINER_HEADER_SIZE..CONTAINER_HEADER_SIZE + dictionary_size;
+        if index_offset < dictionary.end
+            || frame_count.checked_mul(8).and_then(|size| index_offset.checked_add(size))
+            != Some(map.len()) {
+            return Err(invalid(format!("{:?} is truncated or corrupt", path)));
+        }
+
+        // every frame runs up to the next one, and the last one up to
+        // the index
+        let mut offsets: Vec<usize> = map[index_offset..].chunks_exact(8)
+            .map(|offset| u64::from_le_bytes(offset.try_into().unwrap()) as usize)
+            .collect();
+        offsets.push(index_offset);
+        let frames: Vec<Range<usize>> = offsets.windows(2).map(|w| w[0]..w[1]).collect();
+        if frames.iter().any(|frame| frame.start < dictionary.end
+                             || frame.end < frame.start + HEADER_SIZE) {
+            return Err(invalid(format!("{:?} has a corrupt index", path)));
+        }
+
+        Ok(Container { map, framerate, dictionary, frames })
+    }
+
+    pub fn dictionary(&self) -> &[u8] {
+        &self.map[self.dictionary.clone()]
+    }
+
+    pub fn frame_count(&self) -> usize {
+        self.frames.len()
+    }
+
+    /// Frame `n`'s whole message, ready to send.
+    pub fn frame(&self, n: usize) -> &[u8] {
+        &self.map[self.frames[n].clone()]
+    }
+}
@@ -0,0 +1,171 @@
+// Flow control from Sharpie back to the host. Sharpie only has room
+// for a few compressed frames, so if we send frames faster than it can
+// decode and show them, they pile up in USB and on the device, and the
+// display falls further and further behind the video. Every time
+// Sharpie finishes with a frame, it sends a status report back over
+// the vendor IN endpoint, and we only send a new frame when there's a
+// slot free for it. Frames that show up while Sharpie is busy get dropped here,
+// before they're compressed, instead of queueing.
+//
+// The reports also say how long Sharpie took to decode and show a
+// frame, which goes in the occupancy report.
+//
+// Older client firmware never sends reports, so if the first one
+// doesn't show up, we turn all this off and send frames as fast as
+// the pipeline makes them, like we used to.
+
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicU32, Ordering};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use rusb;
+
+use crate::transport::Transport;
+
+/// Five u32s: frames received, frames decoded, full buffers, decode
+/// time, and scanout time (see status_report_t in the client).
+const REPORT_SIZE: usize = 20;
+
+/// Frames that can be sent but not yet decoded. This is the number of
+/// slots in Sharpie's frame ring (FRAME_RING_SLOTS in the client).
+const MAX_IN_FLIGHT: u32 = 4;
+
+/// How long to wait for the first report before deciding the client
+/// doesn't send them.
+const FIRST_REPORT_TIMEOUT: Duration = Duration::from_millis(1000);
+
+/// How long each read waits, so the reader thread notices when it's
+/// time to stop.
+const READ_TIMEOUT: Duration = Duration::from_millis(100);
+
+/// What we know about Sharpie's buffers, shared between the encoder
+/// stages and the thread reading status reports.
+pub struct Credits {
+    /// frames sent since the dictionary, counted when the compress
+    /// stage commits to sending them
+    sent: AtomicU32,
+    /// frames Sharpie says it's done with
+    decoded: AtomicU32,
+    buffers_full: AtomicU32,
+    decode_us: AtomicU32,
+    scanout_us: AtomicU32,
+    reports: AtomicU32,
+    /// frames dropped because Sharpie was busy
+    dropped: AtomicU32,
+    /// whether the client sends reports at all
+    active: AtomicBool,
+    stop: AtomicBool,
+}
+
+impl Credits {
+    pub fn new() -> Arc<Credits> {
+        Arc::new(Credits {
+            sent: AtomicU32::new(0),
+            decoded: AtomicU32::new(0),
+            buffers_full: AtomicU32::new(0),
+            decode_us: AtomicU32::new(0),
+            scanout_us: AtomicU32::new(0),
+            reports: AtomicU32::new(0),
+            dropped: AtomicU32::new(0),
+            active: AtomicBool::new(false),
+            stop: AtomicBool::new(false),
+        })
+    }
+
+    /// Whether Sharpie has room for another frame. Always true if the
+    /// client doesn't send reports.
+    pub fn can_send(&self) -> bool {
+        if !self.active.load(Ordering::Acquire) {
+            return true;
+        }
+        // saturating, because a report left over from the last run can
+        // say more frames were decoded than we've sent
+        let in_flight = self.sent.load(Ordering::Relaxed)
+            .saturating_sub(self.decoded.load(Ordering::Acquire));
+        in_flight < MAX_IN_FLIGHT
+    }
+
+    pub fn sent_frame(&self) {
+        self.sent.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn dropped_frame(&self) {
+        self.dropped.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn dropped(&self) -> u32 {
+        self.dropped.load(Ordering::Relaxed)
+    }
+
+    pub fn is_active(&self) -> bool {
+        self.active.load(Ordering::Acquire)
+    }
+
+    /// Last decode and scanout times Sharpie reported, in microseconds.
+    pub fn device_times_us(&self) -> (u32, u32) {
+        (self.decode_us.load(Ordering::Relaxed), self.scanout_us.load(Ordering::Relaxed))
+    }
+
+    pub fn buffers_full(&self) -> u32 {
+        self.buffers_full.load(Ordering::Relaxed)
+    }
+
+    fn update(&self, report: &[u8; REPORT_SIZE]) {
+        let field = |i: usize| u32::from_le_bytes(report[i * 4..i * 4 + 4].try_into().unwrap());
+        // field 0 (frames received) is only interesting when debugging
+        self.buffers_full.store(field(2), Ordering::Relaxed);
+        self.decode_us.store(field(3), Ordering::Relaxed);
+        self.scanout_us.store(field(4), Ordering::Relaxed);
+        self.decoded.store(field(1), Ordering::Release);
+        self.reports.fetch_add(1, Ordering::Release);
+    }
+
+    /// Wait for the report Sharpie sends once it has loaded the
+    /// dictionary. If it shows up, flow control is on from here.
+    pub fn wait_for_first_report(&self) {
+        let start = Instant::now();
+        while start.elapsed() < FIRST_REPORT_TIMEOUT {
+            if self.reports.load(Ordering::Acquire) > 0 {
+                self.active.store(true, Ordering::Release);
+                return;
+            }
+            thread::sleep(Duration::from_millis(1));
+        }
+        println!("Sharpie didn't send a status report, so flow control is off \
+                  (is the client firmware out of date?)");
+    }
+
+    /// Stop waiting on reports that aren't coming anymore. This turns
+    /// flow control off, so the usb stage goes on writing, and fails
+    /// with whatever broke instead of waiting on credits forever.
+    fn give_up(&self) {
+        self.active.store(false, Ordering::Release);
+    }
+
+    /// Tell the reader thread to stop.
+    pub fn stop(&self) {
+        self.stop.store(true, Ordering::Relaxed);
+    }
+}
+
+/// Read status reports until `credits.stop()` is called.
+pub fn spawn_reader(sharpie: Arc<dyn Transport>,
+                    credits: Arc<Credits>) -> thread::JoinHandle<()> {
+    thread::spawn(move || {
+        let mut report = [0u8; REPORT_SIZE];
+        while !credits.stop.load(Ordering::Relaxed) {
+            match sharpie.read(&mut report, READ_TIMEOUT) {
+                Ok(REPORT_SIZE) => credits.update(&report),
+                // a short report is junk, and a timeout just means
+                // Sharpie is busy (or isn't sending reports)
+                Ok(_) | Err(rusb::Error::Timeout) => (),
+                Err(e) => {
+                    println!("stopped reading status reports: {}", e);
+                    credits.give_up();
+                    break;
+                }
+            }
+        }
+    })
+}
@@ -0,0 +1,66 @@
+// Inter-frame delta coding. Consecutive frames share a lot of their
+// bit planes even when the dither noise makes almost every pixel
+// different, so XORing a frame against the one before it leaves a lot
+// of zero bits for zstd to squash. The client XORs the delta back into
+// its copy of what's on screen.
+//
+// Deltas chain, so every so often (and whenever a delta stops
+// helping, like at a scene cut) we send a keyframe instead: a full
+// frame that doesn't depend on anything before it. That also puts
+// Sharpie back in sync if it ever drops a frame.
+
+/// XOR `next` against `prev` into `delta`. All three have to be the
+/// same length, which for frames is always a multiple of 8.
+pub fn xor_frames(prev: &[u8], next: &[u8], delta: &mut [u8]) {
+    assert_eq!(prev.len(), next.len());
+    assert_eq!(prev.len(), delta.len());
+    // a u64 at a time, which the compiler turns into vector XORs
+    for ((d, p), n) in delta.chunks_exact_mut(8)
+        .zip(prev.chunks_exact(8))
+        .zip(next.chunks_exact(8)) {
+        let x = u64::from_ne_bytes(p.try_into().unwrap())
+            ^ u64::from_ne_bytes(n.try_into().unwrap());
+        d.copy_from_slice(&x.to_ne_bytes());
+    }
+    let tail = prev.len() / 8 * 8;
+    for i in tail..prev.len() {
+        delta[i] = prev[i] ^ next[i];
+    }
+}
+
+/// Decides when to send keyframes.
+pub struct Keyframes {
+    interval: u32,
+    since_keyframe: u32,
+    /// compressed size of the last keyframe
+    keyframe_size: usize,
+}
+
+impl Keyframes {
+    pub fn new(interval: u32) -> Keyframes {
+        Keyframes { interval: interval.max(1), since_keyframe: 0, keyframe_size: 0 }
+    }
+
+    /// Whether the next frame has to be a keyframe no matter what.
+    pub fn due(&self) -> bool {
+        self.keyframe_size == 0 || self.since_keyframe + 1 >= self.interval
+    }
+
+    /// Whether a delta that compressed to `size` bytes isn't worth
+    /// sending. If it's no smaller than the last keyframe, the frames
+    /// don't have much in common anymore (which is what a scene cut
+    /// looks like), and a keyframe is just as cheap and resets the
+    /// chain.
+    pub fn is_scene_cut(&self, size: usize) -> bool {
+        size >= self.keyframe_size
+    }
+
+    pub fn sent_keyframe(&mut self, size: usize) {
+        self.since_keyframe = 0;
+        self.keyframe_size = size;
+    }
+
+    pub fn sent_delta(&mut self) {
+        self.since_keyframe += 1;
+    }
+}
@@ -0,0 +1,75 @@
+// zstd dictionaries for Sharpie frames. Every frame gets compressed on
+// its own, so without a dictionary, zstd starts every frame knowing
+// nothing and the start of each one compresses badly. Formatted frames
+// all look a lot alike (same MSb/LSb row layout, same dither
+// patterns), so a dictionary trained on some of them helps every
+// frame after it.
+//
+// The host sends the dictionary to the client once, before the first
+// frame (see protocol.rs), and the client keeps it loaded as a
+// ZSTD_DDict.
+
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+
+use zstd;
+
+use crate::protocol::MAX_DICTIONARY_SIZE;
+
+/// Frames we hold on to for training. Training time goes up with the
+/// total sample size, and a few hundred frames is plenty.
+const MAX_SAMPLES: usize = 256;
+
+/// Read a dictionary made by `--train-dictionary`.
+pub fn load(path: &Path) -> io::Result<Vec<u8>> {
+    let dictionary = fs::read(path)?;
+    if dictionary.len() > MAX_DICTIONARY_SIZE {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            format!("dictionary is {} bytes, but Sharpie only has room for {}",
+                    dictionary.len(), MAX_DICTIONARY_SIZE)));
+    }
+    Ok(dictionary)
+}
+
+/// Collects payloads from the whole video, evenly spaced, and trains a
+/// dictionary on them at the end.
+pub struct Trainer {
+    output: PathBuf,
+    samples: Vec<Vec<u8>>,
+    /// keep every `stride`th payload
+    stride: usize,
+    seen: usize,
+}
+
+impl Trainer {
+    pub fn new(output: PathBuf) -> Trainer {
+        Trainer { output, samples: Vec::new(), stride: 1, seen: 0 }
+    }
+
+    pub fn add(&mut self, payload: &[u8]) {
+        if self.seen % self.stride == 0 {
+            self.samples.push(payload.to_vec());
+        }
+        self.seen += 1;
+
+        // we don't know how long the video is, so when we run out of
+        // room, drop every other sample and keep half as many from
+        // here on
+        if self.samples.len() == MAX_SAMPLES {
+            let mut keep = false;
+            self.samples.retain(|_| { keep = !keep; keep });
+            self.stride *= 2;
+        }
+    }
+
+    /// Train the dictionary and write it out.
+    pub fn finish(self) -> io::Result<()> {
+        println!("training dictionary on {} of {} frames", self.samples.len(), self.seen);
+        let dictionary = zstd::dict::from_samples(&self.samples, MAX_DICTIONARY_SIZE)?;
+        fs::write(&self.output, &dictionary)?;
+        println!("wrote {} byte dictionary to {:?}", dictionary.len(), self.output);
+        Ok(())
+    }
+}
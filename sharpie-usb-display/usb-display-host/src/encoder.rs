@@ -0,0 +1,845 @@
+// The host's frame encoder, split into stages that each run on their
+// own thread:
+//
+//   appsink -> dither -> compress -> usb
+//
+// (the dither stage writes formatted Sharpie rows directly, so there's
+// no separate format stage.)
+//
+// Every arrow is a bounded queue, so while frame N is being
+// compressed, frame N+1 can be dithered and frame N-1 can be on the
+// wire. The blocking USB write used to stall everything else in the
+// single worker thread, and now it only stalls the usb stage. When a
+// stage falls behind, its input queue fills up and the stages before
+// it block, back to the dither stage's queue. What happens there is up
+// to its `QueuePolicy`: it can block the appsink too (which is fine
+// for a file), or drop frames so a live source never gets more than a
+// couple of frames behind. Frames that sat there past their deadline
+// (from their timestamps on the pipeline clock) are counted as late,
+// and skipped if there's a newer one waiting.
+//
+// The formatted frames go back to the dither stage once the compress
+// stage is done with them, so they get reused instead of reallocated.
+// The compress stage holds on to the last frame it sent, so it can
+// send only the rows that changed (see partial.rs). It also drops
+// frames while Sharpie has no room for them (see credits.rs), so a
+// slow display doesn't leave frames queued up all the way back here.
+//
+// Once the appsink lets go of its sender, every stage finishes what's
+// in its queue and exits, which is what `Encoder::finish` waits for.
+
+use std::collections::VecDeque;
+use std::path::PathBuf;
+use std::sync::{Arc, Condvar, Mutex};
+use std::sync::atomic::{AtomicI32, AtomicU32, AtomicU64, AtomicUsize, Ordering};
+use std::sync::mpsc::{self, Receiver, RecvTimeoutError, Sender, SyncSender};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+use zstd;
+
+use sharpie_core::dither::{DamageDitherer, Ditherer};
+use sharpie_core::format::FRAMESIZE;
+
+use crate::credits::{self, Credits};
+use crate::delta::{self, Keyframes};
+use crate::dictionary;
+use crate::frontend::{Frontend, InputFormat, InputFrame};
+use crate::metrics::{Counters, Histogram, MetricsWriter, Report, StageReport};
+use crate::partial::{self, RowRange};
+use crate::protocol::{self, PayloadType};
+use crate::rate::{self, RateController};
+use crate::transport::Transport;
+
+/// How many frames can wait in front of each stage. Anything more than
+/// a couple just adds latency.
+const QUEUE_DEPTH: usize = 2;
+
+/// Print stage occupancy every this many frames.
+const REPORT_INTERVAL: u64 = 100;
+
+/// Counters for one stage, shared between the stage's thread and the
+/// occupancy report.
+struct StageStats {
+    name: &'static str,
+    /// total time spent working on frames (as opposed to waiting for
+    /// them)
+    busy_ns: AtomicU64,
+    /// frames sitting in this stage's input queue
+    queued: AtomicUsize,
+    /// how long every frame took (for --metrics)
+    times: Histogram,
+}
+
+impl StageStats {
+    fn new(name: &'static str) -> Arc<StageStats> {
+        Arc::new(StageStats {
+            name,
+            busy_ns: AtomicU64::new(0),
+            queued: AtomicUsize::new(0),
+            times: Histogram::default(),
+        })
+    }
+}
+
+/// Sending half of the bounded queue in front of a stage.
+pub struct StageSender<T> {
+    tx: SyncSender<T>,
+    stats: Arc<StageStats>,
+}
+
+impl<T> StageSender<T> {
+    /// Queue `item` for the stage, blocking while its queue is full.
+    pub fn send(&self, item: T) -> Result<(), mpsc::SendError<T>> {
+        self.stats.queued.fetch_add(1, Ordering::Relaxed);
+        self.tx.send(item).inspect_err(|_| {
+            self.stats.queued.fetch_sub(1, Ordering::Relaxed);
+        })
+    }
+}
+
+/// Receiving half of the bounded queue in front of a stage.
+struct StageReceiver<T> {
+    rx: Receiver<T>,
+    stats: Arc<StageStats>,
+}
+
+impl<T> StageReceiver<T> {
+    /// Wait for the next item, or return None once the stage before
+    /// this one has gone away.
+    fn recv(&self) -> Option<T> {
+        let item = self.rx.recv().ok()?;
+        self.stats.queued.fetch_sub(1, Ordering::Relaxed);
+        Some(item)
+    }
+
+    /// Run `work`, counting the time it takes as busy time for this
+    /// stage.
+    fn busy<R>(&self, work: impl FnOnce() -> R) -> R {
+        let start = Instant::now();
+        let result = work();
+        self.add_busy(start.elapsed());
+        result
+    }
+
+    /// Count `elapsed` as time this stage spent on one frame.
+    fn add_busy(&self, elapsed: Duration) {
+        self.stats.busy_ns.fetch_add(elapsed.as_nanos() as u64, Ordering::Relaxed);
+        self.stats.times.record(elapsed);
+    }
+}
+
+fn stage_queue<T>(name: &'static str) -> (StageSender<T>, StageReceiver<T>) {
+    let (tx, rx) = mpsc::sync_channel(QUEUE_DEPTH);
+    let stats = StageStats::new(name);
+    (StageSender { tx, stats: stats.clone() }, StageReceiver { rx, stats })
+}
+
+/// What to do with a frame from the appsink when the dither stage's
+/// queue is full.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, clap::ValueEnum)]
+pub enum QueuePolicy {
+    /// wait for room, which holds up the GStreamer pipeline
+    Block,
+    /// throw out the oldest queued frame to make room
+    DropOldest,
+    /// throw out the new frame
+    DropNewest,
+}
+
+/// Counters for frames that never made it past the dither stage's
+/// queue.
+#[derive(Default)]
+struct ScheduleStats {
+    /// thrown out by the queue policy
+    dropped: AtomicU64,
+    /// picked up after their deadline
+    late: AtomicU64,
+}
+
+struct QueuedFrame {
+    frame: InputFrame,
+    /// when this frame should have started dithering, at the latest
+    deadline: Instant,
+    /// when the appsink handed it over
+    arrived: Instant,
+}
+
+struct FrameQueueState {
+    frames: VecDeque<QueuedFrame>,
+    /// one end or the other is gone. once `frames` is empty, that's
+    /// it.
+    closed: bool,
+    /// a frame's timestamp and when it came in, to turn other frames'
+    /// timestamps into deadlines
+    clock_anchor: Option<(u64, Instant)>,
+}
+
+/// The queue in front of the dither stage. This is a stage queue with
+/// a drop policy, which an mpsc channel can't do.
+struct FrameQueue {
+    state: Mutex<FrameQueueState>,
+    /// signalled when a frame goes in, or the sender goes away
+    not_empty: Condvar,
+    /// signalled when a frame comes out
+    not_full: Condvar,
+    policy: QueuePolicy,
+    max_latency: Duration,
+    stats: Arc<StageStats>,
+    schedule: Arc<ScheduleStats>,
+    counters: Arc<Counters>,
+}
+
+/// Where the appsink sends frames.
+pub struct FrameSender {
+    queue: Arc<FrameQueue>,
+}
+
+impl FrameSender {
+    /// Queue `frame` for the dither stage, following the queue's
+    /// policy when it's full.
+    pub fn send(&self, frame: InputFrame) -> Result<(), mpsc::SendError<InputFrame>> {
+        let now = Instant::now();
+        let result = self.queue_frame(frame, now);
+        self.queue.counters.ingest.record(now.elapsed());
+        result
+    }
+
+    fn queue_frame(&self, frame: InputFrame, now: Instant)
+                   -> Result<(), mpsc::SendError<InputFrame>> {
+        let queue = &self.queue;
+        let mut state = queue.state.lock().unwrap();
+
+        // the pipeline clock says when every frame is due (relative to
+        // the others), so line that up with the time the first one
+        // showed up
+        let due = match frame.buffer.pts() {
+            Some(pts) => {
+                let (anchor_pts, anchor_time) = *state.clock_anchor
+                    .get_or_insert((pts.nseconds(), now));
+                anchor_time + Duration::from_nanos(pts.nseconds().saturating_sub(anchor_pts))
+            }
+            None => now,
+        };
+        let deadline = due.max(now) + queue.max_latency;
+
+        while state.frames.len() >= QUEUE_DEPTH && !state.closed {
+            match queue.policy {
+                QueuePolicy::Block => state = queue.not_full.wait(state).unwrap(),
+                QueuePolicy::DropOldest => {
+                    state.frames.pop_front();
+                    queue.stats.queued.fetch_sub(1, Ordering::Relaxed);
+                    queue.schedule.dropped.fetch_add(1, Ordering::Relaxed);
+                }
+                QueuePolicy::DropNewest => {
+                    queue.schedule.dropped.fetch_add(1, Ordering::Relaxed);
+                    return Ok(());
+                }
+            }
+        }
+        if state.closed {
+            return Err(mpsc::SendError(frame));
+        }
+        state.frames.push_back(QueuedFrame { frame, deadline, arrived: now });
+        queue.stats.queued.fetch_add(1, Ordering::Relaxed);
+        queue.not_empty.notify_one();
+        Ok(())
+    }
+}
+
+impl Drop for FrameSender {
+    fn drop(&mut self) {
+        self.queue.state.lock().unwrap().closed = true;
+        self.queue.not_empty.notify_all();
+    }
+}
+
+/// The dither stage's end of the frame queue.
+struct FrameReceiver {
+    queue: Arc<FrameQueue>,
+}
+
+impl FrameReceiver {
+    /// Wait for the next frame to dither (and when it arrived), or
+    /// return None once the sender is gone and the queue is empty.
+    fn recv(&self) -> Option<(InputFrame, Instant)> {
+        let queue = &self.queue;
+        let mut state = queue.state.lock().unwrap();
+        loop {
+            while state.frames.is_empty() {
+                if state.closed {
+                    return None;
+                }
+                state = queue.not_empty.wait(state).unwrap();
+            }
+            let queued = state.frames.pop_front().unwrap();
+            queue.stats.queued.fetch_sub(1, Ordering::Relaxed);
+            queue.not_full.notify_one();
+            if Instant::now() <= queued.deadline {
+                return Some((queued.frame, queued.arrived));
+            }
+            queue.schedule.late.fetch_add(1, Ordering::Relaxed);
+            // a late frame is still better than nothing, unless
+            // there's a newer one right behind it. blocking means
+            // every frame gets shown, so it never skips.
+            if queue.policy == QueuePolicy::Block || state.frames.is_empty() {
+                return Some((queued.frame, queued.arrived));
+            }
+            queue.schedule.dropped.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    fn busy<R>(&self, work: impl FnOnce() -> R) -> R {
+        let start = Instant::now();
+        let result = work();
+        let elapsed = start.elapsed();
+        self.queue.stats.busy_ns.fetch_add(elapsed.as_nanos() as u64, Ordering::Relaxed);
+        self.queue.stats.times.record(elapsed);
+        result
+    }
+}
+
+impl Drop for FrameReceiver {
+    fn drop(&mut self) {
+        // so a blocked sender finds out
+        self.queue.state.lock().unwrap().closed = true;
+        self.queue.not_full.notify_all();
+    }
+}
+
+fn frame_queue(policy: QueuePolicy, max_latency: Duration,
+               counters: Arc<Counters>) -> (FrameSender, FrameReceiver) {
+    let queue = Arc::new(FrameQueue {
+        state: Mutex::new(FrameQueueState {
+            frames: VecDeque::with_capacity(QUEUE_DEPTH),
+            closed: false,
+            clock_anchor: None,
+        }),
+        not_empty: Condvar::new(),
+        not_full: Condvar::new(),
+        policy,
+        max_latency,
+        stats: StageStats::new("dither"),
+        schedule: Arc::new(ScheduleStats::default()),
+        counters,
+    });
+    (FrameSender { queue: queue.clone() }, FrameReceiver { queue })
+}
+
+/// Frame-sized buffers travel down the pipeline and come back through
+/// one of these, so the stage that fills them doesn't have to allocate
+/// a new one every frame.
+struct BufferPool {
+    returned: Receiver<Vec<u8>>,
+}
+
+impl BufferPool {
+    fn new() -> (BufferPool, Sender<Vec<u8>>) {
+        let (tx, rx) = mpsc::channel();
+        (BufferPool { returned: rx }, tx)
+    }
+
+    /// Get a buffer back from the pool, or make a new one if they're
+    /// all still somewhere down the pipeline.
+    fn get(&self) -> Vec<u8> {
+        self.returned.try_recv().unwrap_or_else(|_| vec![0u8; FRAMESIZE])
+    }
+}
+
+/// Knobs for the encoder, which mostly come straight from the command
+/// line.
+pub struct EncoderOptions {
+    /// threads to dither each frame with (see dither.rs)
+    pub dither_threads: usize,
+    /// send only the rows that changed since the last frame, when
+    /// that's worth it (see partial.rs)
+    pub partial_updates: bool,
+    /// send frames XORed against the one before them (see delta.rs)
+    pub delta: bool,
+    /// with `delta`, send a keyframe at least this often
+    pub keyframe_interval: u32,
+    /// compress every frame with this zstd dictionary (after sending
+    /// it to Sharpie)
+    pub dictionary: Option<Vec<u8>>,
+    /// train a dictionary on this run's frames and write it here once
+    /// the video is done
+    pub train_dictionary: Option<PathBuf>,
+    /// framerate we're aiming for, which sets the per-frame byte budget
+    /// (see rate.rs). This can change later, see RateFeedback.
+    pub framerate: u32,
+    /// compress every frame at this zstd level, instead of letting the
+    /// rate controller pick
+    pub zstd_level: Option<i32>,
+    /// what to do when frames come in faster than they can be dithered
+    pub queue_policy: QueuePolicy,
+    /// how long after its timestamp a frame can start dithering before
+    /// it counts as late
+    pub max_latency: Duration,
+    /// only re-dither the rows that changed since the last frame, and
+    /// skip frames that didn't change at all. This is for sources that
+    /// mostly sit still, like a mirrored desktop.
+    pub damage_tracking: bool,
+    /// write metrics here every so often (see metrics.rs)
+    pub metrics: Option<MetricsWriter>,
+}
+
+/// What `--framerate auto` needs from the encoder while it runs: how
+/// many frames aren't making it through, and a way to tell it about
+/// the new framerate once there is one.
+#[derive(Clone)]
+pub struct RateFeedback {
+    credits: Arc<Credits>,
+    schedule: Arc<ScheduleStats>,
+    framerate: Arc<AtomicU32>,
+}
+
+impl RateFeedback {
+    /// Frames dropped so far, either by the queue policy or because
+    /// Sharpie had no room for them.
+    pub fn dropped(&self) -> u64 {
+        self.schedule.dropped.load(Ordering::Relaxed) + self.credits.dropped() as u64
+    }
+
+    /// Frames are coming in at a new framerate, so the rate controller
+    /// needs a new byte budget.
+    pub fn set_framerate(&self, framerate: u32) {
+        self.framerate.store(framerate, Ordering::Relaxed);
+    }
+}
+
+/// The running stage threads (and the status report reader, if
+/// there's a device).
+pub struct Encoder {
+    threads: Vec<JoinHandle<()>>,
+    feedback: RateFeedback,
+}
+
+impl Encoder {
+    pub fn feedback(&self) -> RateFeedback {
+        self.feedback.clone()
+    }
+
+    /// Wait for every stage to finish. This only returns once the
+    /// sender from `spawn` has been dropped.
+    pub fn finish(self) {
+        for thread in self.threads {
+            let _ = thread.join();
+        }
+    }
+}
+
+/// Start all the stage threads. Frames (240x320 RGBA buffers) go into
+/// the returned sender, and come out of the other end over `sharpie`
+/// (or nowhere, if it's None).
+pub fn spawn(sharpie: Option<Arc<dyn Transport>>,
+             options: EncoderOptions) -> (FrameSender, Encoder) {
+    let counters = Arc::new(Counters::default());
+    let (dither_tx, dither_rx) = frame_queue(options.queue_policy, options.max_latency,
+                                             counters.clone());
+    // frames carry when they came in, for measuring latency
+    let (compress_tx, compress_rx) = stage_queue::<(Vec<u8>, Instant)>("compress");
+    let (usb_tx, usb_rx) = stage_queue::<(Vec<u8>, Instant)>("usb");
+
+    let all_stats = vec![dither_rx.queue.stats.clone(), compress_rx.stats.clone(),
+                         usb_rx.stats.clone()];
+    let schedule = dither_rx.queue.schedule.clone();
+
+    let (formatted_pool, formatted_return) = BufferPool::new();
+
+    // the usb stage writes frames while the reader thread reads status
+    // reports
+    let credits = Credits::new();
+    let framerate = Arc::new(AtomicU32::new(options.framerate));
+    let feedback = RateFeedback {
+        credits: credits.clone(),
+        schedule: schedule.clone(),
+        framerate: framerate.clone(),
+    };
+    let zstd_level = Arc::new(AtomicI32::new(options.zstd_level.unwrap_or(rate::DEFAULT_LEVEL)));
+
+    let mut threads = Vec::new();
+    // the metrics thread stops when the usb stage drops this
+    let (metrics_stop, metrics_stopped) = mpsc::channel::<()>();
+    if let Some(writer) = options.metrics {
+        threads.push(spawn_metrics(writer, metrics_stopped, all_stats.clone(),
+                                   schedule.clone(), credits.clone(), counters.clone(),
+                                   framerate.clone(), zstd_level.clone()));
+    }
+    if let Some(ref sharpie) = sharpie {
+        threads.push(credits::spawn_reader(sharpie.clone(), credits.clone()));
+    }
+
+    let dither_counters = counters.clone();
+    threads.push(thread::spawn(move || {
+        let mut ditherer = Ditherer::new(240, options.dither_threads);
+        // damage tracking dithers serially, since it's usually only got
+        // a few rows to do
+        let mut damage_ditherer = options.damage_tracking.then(|| DamageDitherer::new(240));
+        // a buffer that didn't get used because its frame didn't change
+        let mut spare = None;
+        // YUV frames get scaled, rotated, and converted into here (see
+        // frontend.rs)
+        let mut frontend = Frontend::new();
+        let mut rgb = vec![0u8; FRAMESIZE * 3];
+        while let Some((frame, arrived)) = dither_rx.recv() {
+            let mut formatted = spare.take().unwrap_or_else(|| formatted_pool.get());
+            let changed = dither_rx.busy(|| {
+                let map = frame.buffer.map_readable().unwrap();
+                // dither straight out of the GStreamer buffer when it's
+                // a 240x320 RGBA image already (the ditherer just skips
+                // the alpha bytes), and out of the front end's RGB
+                // otherwise
+                let (src, src_bpp) = match frame.layout.format {
+                    InputFormat::Rgba => (map.as_slice(), 4),
+                    _ => {
+                        let start = Instant::now();
+                        frontend.convert(map.as_slice(), &frame.layout, &mut rgb);
+                        dither_counters.convert.record(start.elapsed());
+                        (&rgb[..], 3)
+                    },
+                };
+                match damage_ditherer {
+                    Some(ref mut damage_ditherer) =>
+                        damage_ditherer.dither_to_sharpie(src, src_bpp, &mut formatted)
+                            .is_some(),
+                    None => {
+                        ditherer.dither_to_sharpie(src, src_bpp, &mut formatted);
+                        true
+                    },
+                }
+            });
+            if !changed {
+                // same picture as last time, so there's nothing to send
+                dither_counters.unchanged.fetch_add(1, Ordering::Relaxed);
+                spare = Some(formatted);
+                continue;
+            }
+            if compress_tx.send((formatted, arrived)).is_err() {
+                break;
+            }
+        }
+    }));
+
+    let dictionary = options.dictionary.clone();
+    let compress_credits = credits.clone();
+    let compress_zstd_level = zstd_level.clone();
+    threads.push(thread::spawn(move || {
+	// we reach diminishing returns (~50-100 bytes saved per one
+	// compression level increase) after level 6 fairly
+	// consistently. zstd benchmark puts level 6 at ~70MB/s, which
+	// is plenty fast. that's where the rate controller starts, and
+	// it moves from there as frames get busier or quieter.
+        let mut rate = options.zstd_level.is_none()
+            .then(|| RateController::new(options.framerate));
+        let mut current_framerate = options.framerate;
+        let level = options.zstd_level.unwrap_or(rate::DEFAULT_LEVEL);
+        let mut compressor = new_compressor(level, options.dictionary.as_deref());
+        let mut trainer = options.train_dictionary.map(dictionary::Trainer::new);
+        // the last frame we sent, which is what's on the display now
+        // (USB errors are fatal, so it can't be anything else)
+        let mut last_sent: Option<Vec<u8>> = None;
+        let mut partial_stream = Vec::new();
+        let mut delta_frame = vec![0u8; FRAMESIZE];
+        let mut keyframes = Keyframes::new(options.keyframe_interval);
+        while let Some((formatted, arrived)) = compress_rx.recv() {
+            if !compress_credits.can_send() {
+                // Sharpie's buffers are full. this frame would just
+                // sit somewhere waiting, and by the time it got shown
+                // it would be late, so drop it. the next frame gets
+                // diffed against what's actually on the display.
+                compress_credits.dropped_frame();
+                let _ = formatted_return.send(formatted);
+                continue;
+            }
+            let start = Instant::now();
+            let compressed = compress_rx.busy(|| {
+                let ranges = match last_sent {
+                    Some(ref prev) if options.partial_updates =>
+                        Some(partial::dirty_ranges(prev, &formatted)),
+                    _ => None,
+                };
+                if ranges.as_ref().is_some_and(|ranges| ranges.is_empty()) {
+                    // nothing changed, and the display holds its image
+                    // on its own, so there's nothing to send
+                    return None;
+                }
+                // no ranges means a full frame
+                let ranges = ranges
+                    .filter(|ranges| partial::range_rows(ranges) <= partial::PARTIAL_MAX_ROWS)
+                    .unwrap_or_default();
+
+                if !options.delta {
+                    let payload = build_payload(&formatted, &ranges, &mut partial_stream);
+                    if let Some(ref mut trainer) = trainer {
+                        trainer.add(payload);
+                    }
+                    return Some(compress_payload(&mut compressor, payload,
+                                                 PayloadType::Frame, &ranges));
+                }
+
+                if let Some(ref prev) = last_sent {
+                    if !keyframes.due() {
+                        delta::xor_frames(prev, &formatted, &mut delta_frame);
+                        let payload = build_payload(&delta_frame, &ranges, &mut partial_stream);
+                        let compressed = compress_payload(&mut compressor, payload,
+                                                          PayloadType::DeltaFrame, &ranges);
+                        if !keyframes.is_scene_cut(compressed.len()) {
+                            if let Some(ref mut trainer) = trainer {
+                                trainer.add(payload);
+                            }
+                            keyframes.sent_delta();
+                            return Some(compressed);
+                        }
+                    }
+                }
+
+                // keyframes are always full frames, so they bring the
+                // whole display back in sync
+                if let Some(ref mut trainer) = trainer {
+                    trainer.add(&formatted);
+                }
+                let compressed = compress_payload(&mut compressor, &formatted,
+                                                  PayloadType::Frame, &[]);
+                keyframes.sent_keyframe(compressed.len());
+                Some(compressed)
+            });
+            if let (Some(rate), Some(compressed)) = (&mut rate, &compressed) {
+                let device_decode_time = compress_credits.is_active().then(|| {
+                    Duration::from_micros(compress_credits.device_times_us().0 as u64)
+                });
+                let new_framerate = framerate.load(Ordering::Relaxed);
+                if new_framerate != current_framerate {
+                    current_framerate = new_framerate;
+                    rate.set_framerate(new_framerate);
+                }
+                let level = rate.level();
+                if rate.update(compressed.len(), start.elapsed(), device_decode_time) != level {
+                    // zstd builds its tables for the dictionary at the
+                    // level in force when it's first used, and then
+                    // ignores level changes, so load it again.
+                    // set_compression_level() would load no dictionary
+                    // at all. the window log stays either way.
+                    compressor.set_dictionary(rate.level(), options.dictionary.as_deref().unwrap_or_default()).unwrap();
+                    compress_zstd_level.store(rate.level(), Ordering::Relaxed);
+                }
+            }
+            // hang on to this frame to diff the next one against, and
+            // give the one before it back to the dither stage
+            if compressed.is_some() {
+                compress_credits.sent_frame();
+                if let Some(prev) = last_sent.replace(formatted) {
+                    let _ = formatted_return.send(prev);
+                }
+            } else {
+                let _ = formatted_return.send(formatted);
+            }
+            if let Some(compressed) = compressed {
+                if usb_tx.send((compressed, arrived)).is_err() {
+                    break;
+                }
+            }
+        }
+        if let Some(trainer) = trainer {
+            if let Err(e) = trainer.finish() {
+                println!("failed to train dictionary: {}", e);
+            }
+        }
+    }));
+
+    threads.push(thread::spawn(move || {
+        let mut count: u64 = 0;
+        let mut report = OccupancyReport::new(all_stats, schedule, credits.clone(), zstd_level);
+        // the dictionary has to get there before any frames that use
+        // it. when we don't have one, an empty one clears out whatever
+        // Sharpie had from last time.
+        if let Some(ref sharpie) = sharpie {
+            let dictionary = dictionary.unwrap_or_default();
+            println!("sending {} byte dictionary", dictionary.len());
+            sharpie.write(
+                &protocol::dictionary_message(&dictionary),
+                Duration::from_millis(1000)).unwrap();
+            // Sharpie reports in once it's loaded the dictionary
+            credits.wait_for_first_report();
+            // and that wasn't a frame
+            sharpie.take_write_times();
+        }
+        // moved in so that it's dropped when this stage ends
+        let _metrics_stop = metrics_stop;
+        while let Some((compressed, arrived)) = usb_rx.recv() {
+            // if we're in no_usb mode, we don't need to write to the device
+            if let Some(ref sharpie) = sharpie {
+                let start = Instant::now();
+                sharpie.write(
+                    &compressed,
+                    // 1000 ms timeout is plenty
+                    Duration::from_millis(1000)).unwrap();
+                // an asynchronous write comes back as soon as the frame's
+                // queued up, so count the time frames spent going out
+                // instead. that's what this stage is waiting on.
+                match sharpie.take_write_times() {
+                    Some(times) => times.into_iter().for_each(|time| usb_rx.add_busy(time)),
+                    None => usb_rx.add_busy(start.elapsed()),
+                }
+            }
+            println!("wrote frame {}, size = {}", count, compressed.len());
+            counters.frames.fetch_add(1, Ordering::Relaxed);
+            counters.bytes.fetch_add(compressed.len() as u64, Ordering::Relaxed);
+            counters.max_frame_bytes.fetch_max(compressed.len() as u64, Ordering::Relaxed);
+            counters.latency.record(arrived.elapsed());
+
+            count += 1;
+            if count % REPORT_INTERVAL == 0 {
+                report.print(REPORT_INTERVAL);
+            }
+        }
+        println!("main loop disconnected");
+        credits.stop();
+    }));
+
+    (dither_tx, Encoder { threads, feedback })
+}
+
+/// Start the thread that writes a metrics report every interval, and
+/// one last one when `stopped` says the pipeline's done.
+#[allow(clippy::too_many_arguments)]
+fn spawn_metrics(mut writer: MetricsWriter, stopped: Receiver<()>, stats: Vec<Arc<StageStats>>,
+                 schedule: Arc<ScheduleStats>, credits: Arc<Credits>, counters: Arc<Counters>,
+                 framerate: Arc<AtomicU32>, zstd_level: Arc<AtomicI32>) -> JoinHandle<()> {
+    thread::spawn(move || {
+        let start = Instant::now();
+        let mut last = start;
+        loop {
+            let done = !matches!(stopped.recv_timeout(writer.interval()),
+                                 Err(RecvTimeoutError::Timeout));
+            let now = Instant::now();
+            let interval = now - last;
+            last = now;
+
+            // the front end runs in the dither stage (and dither counts
+            // it too), but it's worth knowing on its own
+            let mut stages = vec![
+                ("ingest", counters.ingest.take(), None),
+                ("convert", counters.convert.take(), None),
+            ];
+            stages.extend(stats.iter().map(|stage| {
+                (stage.name, stage.times.take(), Some(stage.queued.load(Ordering::Relaxed)))
+            }));
+            let report = Report {
+                elapsed: now - start,
+                interval,
+                frames: counters.frames.swap(0, Ordering::Relaxed),
+                bytes: counters.bytes.swap(0, Ordering::Relaxed),
+                max_frame_bytes: counters.max_frame_bytes.swap(0, Ordering::Relaxed),
+                stages: stages.into_iter().map(|(name, times, queued)| StageReport {
+                    name,
+                    busy: times.count as f64 * times.mean_us / 1e6 / interval.as_secs_f64(),
+                    times,
+                    queued,
+                }).collect(),
+                latency: counters.latency.take(),
+                framerate: framerate.load(Ordering::Relaxed),
+                zstd_level: zstd_level.load(Ordering::Relaxed),
+                dropped_queue: schedule.dropped.load(Ordering::Relaxed),
+                late: schedule.late.load(Ordering::Relaxed),
+                dropped_sharpie: credits.dropped() as u64,
+                unchanged: counters.unchanged.load(Ordering::Relaxed),
+                sharpie: credits.is_active().then(|| {
+                    let (decode_us, scanout_us) = credits.device_times_us();
+                    (decode_us, scanout_us, credits.buffers_full())
+                }),
+            };
+            if let Err(e) = writer.write(&report) {
+                println!("failed to write metrics: {}", e);
+                return;
+            }
+            if done {
+                return;
+            }
+        }
+    })
+}
+
+/// What actually gets compressed for `ranges` of `frame` (which can be
+/// a formatted frame or a delta): the whole thing for a full frame, or
+/// a partial stream built in `partial_stream`.
+fn build_payload<'a>(frame: &'a [u8], ranges: &[RowRange],
+                     partial_stream: &'a mut Vec<u8>) -> &'a [u8] {
+    if ranges.is_empty() {
+        frame
+    } else {
+        partial::build_partial_stream(frame, ranges, partial_stream);
+        partial_stream
+    }
+}
+
+/// A compressor set up the way the compress stage uses it, which is
+/// what the benchmarks want too.
+pub fn new_compressor(level: i32, dictionary: Option<&[u8]>) -> zstd::bulk::Compressor<'static> {
+    let mut compressor = zstd::bulk::Compressor::with_dictionary(level, dictionary.unwrap_or_default())
+        .unwrap();
+    // the client decompresses frames a few rows at a time, and only has
+    // room for a small window
+    compressor.set_parameter(zstd::zstd_safe::CParameter::WindowLog(protocol::MAX_WINDOW_LOG)).unwrap();
+    compressor
+}
+
+fn compress_payload(compressor: &mut zstd::bulk::Compressor, payload: &[u8],
+                    payload_type: PayloadType, ranges: &[RowRange]) -> Vec<u8> {
+    let mut compressed = compressor.compress(payload).unwrap();
+    // put the header on the front. zstd includes the decompressed
+    // length in its frame format but Sharpie needs to know how much to
+    // read on the fly, and which rows it's getting.
+    compressed.splice(0..0, protocol::header(payload_type, compressed.len(), ranges));
+    compressed
+}
+
+/// Prints how busy each stage has been since the last report. A stage
+/// near 100% is the bottleneck, and the stages in front of it will
+/// show full queues. When Sharpie sends status reports, this also
+/// prints how long it's taking and how many frames we've dropped for
+/// it.
+struct OccupancyReport {
+    stats: Vec<Arc<StageStats>>,
+    last_busy_ns: Vec<u64>,
+    last_report: Instant,
+    schedule: Arc<ScheduleStats>,
+    credits: Arc<Credits>,
+    /// the level the compress stage is using right now
+    zstd_level: Arc<AtomicI32>,
+}
+
+impl OccupancyReport {
+    fn new(stats: Vec<Arc<StageStats>>, schedule: Arc<ScheduleStats>, credits: Arc<Credits>,
+           zstd_level: Arc<AtomicI32>) -> OccupancyReport {
+        let last_busy_ns = vec![0; stats.len()];
+        OccupancyReport { stats, last_busy_ns, last_report: Instant::now(), schedule, credits,
+                          zstd_level }
+    }
+
+    fn print(&mut self, frames: u64) {
+        let elapsed = self.last_report.elapsed();
+        self.last_report = Instant::now();
+
+        let mut line = format!("last {} frames in {:.2} s ({:.1} fps):",
+                               frames, elapsed.as_secs_f64(),
+                               frames as f64 / elapsed.as_secs_f64());
+        for (stats, last_busy_ns) in self.stats.iter().zip(self.last_busy_ns.iter_mut()) {
+            let busy_ns = stats.busy_ns.load(Ordering::Relaxed);
+            let occupancy = (busy_ns - *last_busy_ns) as f64 / elapsed.as_nanos() as f64;
+            *last_busy_ns = busy_ns;
+            line += &format!(" {} {:.0}% (queue {})", stats.name, occupancy * 100.0,
+                             stats.queued.load(Ordering::Relaxed));
+        }
+        line += &format!(" zstd level {}, {} dropped and {} late before dithering",
+                         self.zstd_level.load(Ordering::Relaxed),
+                         self.schedule.dropped.load(Ordering::Relaxed),
+                         self.schedule.late.load(Ordering::Relaxed));
+        if self.credits.is_active() {
+            let (decode_us, scanout_us) = self.credits.device_times_us();
+            line += &format!(" sharpie decode {:.1} ms scanout {:.1} ms (buffers {}), {} dropped",
+                             decode_us as f64 / 1000.0, scanout_us as f64 / 1000.0,
+                             self.credits.buffers_full(), self.credits.dropped());
+        }
+        println!("{}", line);
+    }
+}
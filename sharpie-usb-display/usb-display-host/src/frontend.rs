@@ -0,0 +1,264 @@
+// The front end for video files. GStreamer used to turn every decoded
+// frame into what the ditherer wants with `videoflip ! videoconvert !
+// videoscale`, which for a 1080p video is three passes over two
+// million pixels (and a full-size RGBA frame in between each) just to
+// end up with 76,800 of them. Instead, the pipeline hands over the
+// decoder's own I420 or NV12 frames, and this does the scale, the 90°
+// rotation, and YUV to RGB all at once, only ever touching the source
+// pixels that end up on Sharpie, and writes packed RGB8 straight into
+// the dither stage's input.
+//
+// Sharpie's 240x320 screen shows a 320x240 landscape picture rotated
+// clockwise, so every output row runs down a column of the source.
+// Reading that way would jump a whole source row for every pixel, so
+// this goes the other way around: one output column at a time, which
+// reads along a single source row, and writes down the (small, and
+// already in cache) output frame instead.
+
+use gstreamer as gst;
+use gstreamer_video as gst_video;
+
+use sharpie_core::format::FRAMESIZE;
+
+/// Sharpie's screen, after rotating.
+const OUT_WIDTH: usize = 240;
+const OUT_HEIGHT: usize = 320;
+
+/// Marks an output row or column that's in the letterbox, and stays
+/// black.
+const BORDER: u32 = u32::MAX;
+
+/// What the appsink can hand over.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum InputFormat {
+    /// already scaled and rotated to 240x320 by GStreamer
+    Rgba,
+    /// 8-bit Y plane, then quarter-size U and V planes
+    I420,
+    /// 8-bit Y plane, then a quarter-size plane of interleaved U and V
+    Nv12,
+}
+
+/// Which YUV to RGB conversion a video wants.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum ColorMatrix {
+    Bt601,
+    Bt709,
+}
+
+/// Where everything is in a frame buffer.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub struct InputLayout {
+    pub format: InputFormat,
+    pub width: usize,
+    pub height: usize,
+    /// bytes per row of each plane, for as many planes as the format
+    /// has
+    pub strides: [usize; 3],
+    /// where each plane starts in the buffer
+    pub offsets: [usize; 3],
+    pub matrix: ColorMatrix,
+}
+
+/// A frame from the appsink, and how to read it.
+pub struct InputFrame {
+    pub buffer: gst::Buffer,
+    pub layout: InputLayout,
+}
+
+impl InputLayout {
+    /// What the RGBA pipeline (and --mirror) hands over.
+    pub const SHARPIE_RGBA: InputLayout = InputLayout {
+        format: InputFormat::Rgba,
+        width: OUT_WIDTH,
+        height: OUT_HEIGHT,
+        strides: [OUT_WIDTH * 4, 0, 0],
+        offsets: [0, 0, 0],
+        matrix: ColorMatrix::Bt601,
+    };
+
+    /// Work out the layout of `buffer` from its sample's caps, and
+    /// its video meta if it has one (decoders with padded planes use
+    /// that to say so). Returns None for formats we can't read.
+    pub fn from_sample(sample: &gst::Sample, buffer: &gst::BufferRef) -> Option<InputLayout> {
+        let info = gst_video::VideoInfo::from_caps(sample.caps()?).ok()?;
+        let format = match info.format() {
+            gst_video::VideoFormat::Rgba => InputFormat::Rgba,
+            gst_video::VideoFormat::I420 => InputFormat::I420,
+            gst_video::VideoFormat::Nv12 => InputFormat::Nv12,
+            _ => return None,
+        };
+        let (strides, offsets) = match buffer.meta::<gst_video::VideoMeta>() {
+            Some(meta) => (meta.stride().to_vec(), meta.offset().to_vec()),
+            None => (info.stride().to_vec(), info.offset().to_vec()),
+        };
+        let mut layout = InputLayout {
+            format,
+            width: info.width() as usize,
+            height: info.height() as usize,
+            strides: [0; 3],
+            offsets: [0; 3],
+            // HD video is nearly always BT.709, and SD BT.601, which is
+            // also what GStreamer guesses when the caps don't say
+            matrix: match info.colorimetry().matrix() {
+                gst_video::VideoColorMatrix::Bt709 => ColorMatrix::Bt709,
+                gst_video::VideoColorMatrix::Bt601 => ColorMatrix::Bt601,
+                _ if info.height() >= 720 => ColorMatrix::Bt709,
+                _ => ColorMatrix::Bt601,
+            },
+        };
+        for plane in 0..layout.planes() {
+            // negative strides (bottom-up images) don't happen with
+            // these formats
+            layout.strides[plane] = usize::try_from(*strides.get(plane)?).ok()?;
+            layout.offsets[plane] = *offsets.get(plane)?;
+        }
+        Some(layout)
+    }
+
+    fn planes(&self) -> usize {
+        match self.format {
+            InputFormat::Rgba => 1,
+            InputFormat::I420 => 3,
+            InputFormat::Nv12 => 2,
+        }
+    }
+
+    /// Rows and bytes per row actually used in every plane.
+    fn plane_size(&self, plane: usize) -> (usize, usize) {
+        let chroma_width = self.width.div_ceil(2);
+        let chroma_height = self.height.div_ceil(2);
+        match (self.format, plane) {
+            (InputFormat::Rgba, _) => (self.height, self.width * 4),
+            (_, 0) => (self.height, self.width),
+            (InputFormat::I420, _) => (chroma_height, chroma_width),
+            (InputFormat::Nv12, _) => (chroma_height, chroma_width * 2),
+        }
+    }
+
+    /// Whether a `size` byte buffer has room for everything this says
+    /// is in it, and it's something the dither stage can take.
+    pub fn fits(&self, size: usize) -> bool {
+        if self.format == InputFormat::Rgba
+            && (self.width != OUT_WIDTH || self.height != OUT_HEIGHT) {
+            return false;
+        }
+        self.width > 0 && self.height > 0 && (0..self.planes()).all(|plane| {
+            let (rows, row_bytes) = self.plane_size(plane);
+            self.strides[plane] >= row_bytes
+                && self.offsets[plane] + self.strides[plane] * (rows - 1) + row_bytes <= size
+        })
+    }
+}
+
+/// Fixed-point (x256) YUV to RGB coefficients for limited range video:
+/// Y scale, V to red, U to green, V to green, U to blue.
+const BT601: [i32; 5] = [298, 409, 100, 208, 516];
+const BT709: [i32; 5] = [298, 459, 55, 136, 541];
+
+/// Scales, rotates, and colour converts YUV frames into 240x320 packed
+/// RGB8. It only allocates when the input size changes.
+pub struct Frontend {
+    /// the size the maps below are for
+    size: Option<(usize, usize)>,
+    /// for every output row, the two source columns it averages (or
+    /// BORDER)
+    src_x: Vec<[u32; 2]>,
+    /// for every output column, the two source rows it averages (or
+    /// BORDER)
+    src_y: Vec<[u32; 2]>,
+}
+
+impl Frontend {
+    pub fn new() -> Frontend {
+        Frontend { size: None, src_x: Vec::new(), src_y: Vec::new() }
+    }
+
+    /// Convert a YUV frame laid out like `layout` into `rgb`, which
+    /// holds a 240x320 packed RGB8 image.
+    pub fn convert(&mut self, src: &[u8], layout: &InputLayout, rgb: &mut [u8]) {
+        assert_ne!(layout.format, InputFormat::Rgba, "RGBA frames don't need converting");
+        assert_eq!(rgb.len(), FRAMESIZE * 3);
+        if self.size != Some((layout.width, layout.height)) {
+            self.build_maps(layout.width, layout.height);
+        }
+        let [ys, uvr, gu, gv, bu] = match layout.matrix {
+            ColorMatrix::Bt601 => BT601,
+            ColorMatrix::Bt709 => BT709,
+        };
+        let out_stride = OUT_WIDTH * 3;
+
+        for (col, &[y0, y1]) in self.src_y.iter().enumerate() {
+            if y0 == BORDER {
+                for row in 0..OUT_HEIGHT {
+                    rgb[row * out_stride + col * 3..][..3].fill(0);
+                }
+                continue;
+            }
+            let (y0, y1) = (y0 as usize, y1 as usize);
+            let luma = |y: usize| &src[layout.offsets[0] + y * layout.strides[0]..];
+            let (luma0, luma1) = (luma(y0), luma(y1));
+            // chroma is one sample per 2x2 pixels
+            let chroma_row = |plane: usize| {
+                &src[layout.offsets[plane] + (y0 / 2) * layout.strides[plane]..]
+            };
+            let (u_row, v_row) = match layout.format {
+                InputFormat::I420 => (chroma_row(1), chroma_row(2)),
+                _ => (chroma_row(1), chroma_row(1)),
+            };
+
+            for (row, &[x0, x1]) in self.src_x.iter().enumerate() {
+                let out = &mut rgb[row * out_stride + col * 3..][..3];
+                if x0 == BORDER {
+                    out.fill(0);
+                    continue;
+                }
+                let (x0, x1) = (x0 as usize, x1 as usize);
+                let y = (luma0[x0] as i32 + luma0[x1] as i32
+                         + luma1[x0] as i32 + luma1[x1] as i32 + 2) >> 2;
+                let (u, v) = match layout.format {
+                    InputFormat::I420 => (u_row[x0 / 2], v_row[x0 / 2]),
+                    _ => (u_row[x0 / 2 * 2], u_row[x0 / 2 * 2 + 1]),
+                };
+                let y = (y - 16) * ys + 128;
+                let (u, v) = (u as i32 - 128, v as i32 - 128);
+                out[0] = ((y + uvr * v) >> 8).clamp(0, 255) as u8;
+                out[1] = ((y - gu * u - gv * v) >> 8).clamp(0, 255) as u8;
+                out[2] = ((y + bu * u) >> 8).clamp(0, 255) as u8;
+            }
+        }
+    }
+
+    /// Work out which source pixels every output pixel comes from.
+    /// The picture gets scaled to fit 320x240 (before rotating) without
+    /// changing its shape, with black bars on the sides that don't
+    /// fill, like videoscale does.
+    fn build_maps(&mut self, width: usize, height: usize) {
+        // the landscape picture, before rotating
+        let (land_width, land_height) = (OUT_HEIGHT, OUT_WIDTH);
+        let scale = (land_width as f64 / width as f64).min(land_height as f64 / height as f64);
+        let scaled_width = ((width as f64 * scale).round() as usize).clamp(1, land_width);
+        let scaled_height = ((height as f64 * scale).round() as usize).clamp(1, land_height);
+
+        // map `len` landscape pixels onto `src_len` source pixels,
+        // centred, with the two source pixels around each one's centre
+        let axis = |len: usize, scaled: usize, src_len: usize| -> Vec<[u32; 2]> {
+            let start = (len - scaled) / 2;
+            (0..len).map(|i| {
+                if i < start || i >= start + scaled {
+                    return [BORDER; 2];
+                }
+                let centre = ((i - start) as f64 + 0.5) * src_len as f64 / scaled as f64;
+                let first = ((centre - 0.5).floor().max(0.0) as usize).min(src_len - 1);
+                [first as u32, (first + 1).min(src_len - 1) as u32]
+            }).collect()
+        };
+
+        // rotating clockwise, output row r is landscape column r, and
+        // output column c is landscape row 239 - c
+        self.src_x = axis(land_width, scaled_width, width);
+        self.src_y = axis(land_height, scaled_height, height);
+        self.src_y.reverse();
+        self.size = Some((width, height));
+    }
+}
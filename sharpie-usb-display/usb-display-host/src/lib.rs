@@ -0,0 +1,18 @@
+// Everything but the command line and the GStreamer pipeline lives
+// here. The dither and format kernels are in sharpie-core, shared with
+// sharpie-formatter.
+
+pub mod encoder;
+pub mod frontend;
+pub mod partial;
+pub mod protocol;
+pub mod dictionary;
+pub mod delta;
+pub mod credits;
+pub mod transport;
+pub mod async_usb;
+pub mod loopback;
+pub mod container;
+pub mod playback;
+pub mod rate;
+pub mod metrics;
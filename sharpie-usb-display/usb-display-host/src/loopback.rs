@@ -0,0 +1,315 @@
+// A virtual Sharpie, for running the whole host without a board. It
+// runs on its own thread and does what the client does with every
+// message: reads the header, loads dictionaries, decompresses frames
+// with zstd, checks that they come out the size the header says they
+// should, applies them to its copy of the screen (XORing deltas back
+// in), and sends status reports back so flow control works like it
+// does with the real thing.
+//
+// It can also hold writes to the speed of full-speed USB, which is
+// what the real Sharpie is stuck with, so the fps it reports is about
+// what the real one would get (minus the display itself, which is
+// never the bottleneck).
+
+use std::sync::Mutex;
+use std::sync::mpsc::{self, Receiver, RecvTimeoutError, SyncSender};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+use rusb;
+use zstd;
+
+use sharpie_core::format::FRAMESIZE;
+
+use crate::partial::{ROW_BYTES, ROWS, MAX_RANGES, RowRange};
+use crate::protocol::{self, HEADER_SIZE, MAX_DICTIONARY_SIZE, PayloadType};
+use crate::transport::Transport;
+
+/// The most bulk data full-speed USB can move: 19 64-byte packets in
+/// every 1 ms frame. Real hosts get a little less than this.
+const FULL_SPEED_BYTES_PER_SEC: f64 = 19.0 * 64.0 * 1000.0;
+
+/// Like on the real Sharpie, one message can wait while another is
+/// being decoded. Past that, writes block.
+const MESSAGE_QUEUE_DEPTH: usize = 1;
+
+/// What the virtual Sharpie saw, printed when it's done.
+#[derive(Default)]
+struct Summary {
+    frames: u64,
+    /// frames that didn't decode, or came out the wrong size
+    bad_frames: u64,
+    dictionaries: u64,
+    bytes: u64,
+    decode_time: Duration,
+    first_frame: Option<Instant>,
+    last_frame: Option<Instant>,
+}
+
+impl Summary {
+    fn print(&self) {
+        let elapsed = match (self.first_frame, self.last_frame) {
+            (Some(first), Some(last)) => last - first,
+            _ => Duration::ZERO,
+        };
+        let fps = if self.frames > 1 && !elapsed.is_zero() {
+            (self.frames - 1) as f64 / elapsed.as_secs_f64()
+        } else {
+            0.0
+        };
+        println!("loopback: {} frames ({} bad) and {} dictionaries, {} bytes in {:.2} s \
+                  ({:.1} fps, {:.0} KB/s), {:.2} ms average decode",
+                 self.frames, self.bad_frames, self.dictionaries, self.bytes,
+                 elapsed.as_secs_f64(), fps,
+                 self.bytes as f64 / elapsed.as_secs_f64().max(f64::EPSILON) / 1000.0,
+                 self.decode_time.as_secs_f64() * 1000.0 / self.frames.max(1) as f64);
+    }
+}
+
+/// The host's end of a virtual Sharpie.
+pub struct Loopback {
+    messages: Mutex<Option<SyncSender<Vec<u8>>>>,
+    reports: Mutex<Receiver<Vec<u8>>>,
+    device: Mutex<Option<JoinHandle<()>>>,
+    /// bytes per second to hold writes to, if any
+    rate_limit: Option<f64>,
+}
+
+impl Loopback {
+    /// Start a virtual Sharpie. With `full_speed`, writes take as long
+    /// as they would over full-speed USB.
+    pub fn new(full_speed: bool) -> Loopback {
+        let (message_tx, message_rx) = mpsc::sync_channel::<Vec<u8>>(MESSAGE_QUEUE_DEPTH);
+        let (report_tx, report_rx) = mpsc::channel();
+        let device = thread::spawn(move || {
+            let mut device = VirtualSharpie::new(report_tx);
+            while let Ok(data) = message_rx.recv() {
+                device.receive(&data);
+            }
+            device.summary.print();
+        });
+        Loopback {
+            messages: Mutex::new(Some(message_tx)),
+            reports: Mutex::new(report_rx),
+            device: Mutex::new(Some(device)),
+            rate_limit: full_speed.then_some(FULL_SPEED_BYTES_PER_SEC),
+        }
+    }
+
+    /// Disconnect the virtual Sharpie and wait for it to print what it
+    /// saw.
+    pub fn finish(&self) {
+        self.messages.lock().unwrap().take();
+        if let Some(device) = self.device.lock().unwrap().take() {
+            let _ = device.join();
+        }
+    }
+}
+
+impl Transport for Loopback {
+    // the timeout doesn't do anything here, because the virtual
+    // Sharpie never stops taking data for long
+    fn write(&self, data: &[u8], _timeout: Duration) -> rusb::Result<usize> {
+        let start = Instant::now();
+        let messages = self.messages.lock().unwrap();
+        let messages = messages.as_ref().ok_or(rusb::Error::NoDevice)?;
+        messages.send(data.to_vec()).map_err(|_| rusb::Error::NoDevice)?;
+        if let Some(rate) = self.rate_limit {
+            let wire_time = Duration::from_secs_f64(data.len() as f64 / rate);
+            if let Some(left) = wire_time.checked_sub(start.elapsed()) {
+                thread::sleep(left);
+            }
+        }
+        Ok(data.len())
+    }
+
+    fn read(&self, buf: &mut [u8], timeout: Duration) -> rusb::Result<usize> {
+        match self.reports.lock().unwrap().recv_timeout(timeout) {
+            Ok(report) => {
+                let len = report.len().min(buf.len());
+                buf[..len].copy_from_slice(&report[..len]);
+                Ok(len)
+            }
+            Err(RecvTimeoutError::Timeout) => Err(rusb::Error::Timeout),
+            Err(RecvTimeoutError::Disconnected) => Err(rusb::Error::NoDevice),
+        }
+    }
+}
+
+/// The device end, which plays the part of sharpie-usb-display-client.c.
+struct VirtualSharpie {
+    /// bytes that have come in but don't make up a whole message yet
+    stream: Vec<u8>,
+    decompressor: zstd::bulk::Decompressor<'static>,
+    framebuffer: Vec<u8>,
+    screen: Vec<u8>,
+    reports: mpsc::Sender<Vec<u8>>,
+    frames_received: u32,
+    summary: Summary,
+}
+
+/// A decompressor that turns down the same frames the client does.
+fn new_decompressor(dictionary: &[u8]) -> zstd::bulk::Decompressor<'static> {
+    let mut decompressor = if dictionary.is_empty() {
+        zstd::bulk::Decompressor::new()
+    } else {
+        zstd::bulk::Decompressor::with_dictionary(dictionary)
+    }.unwrap();
+    decompressor.set_parameter(zstd::zstd_safe::DParameter::WindowLogMax(protocol::MAX_WINDOW_LOG)).unwrap();
+    decompressor
+}
+
+impl VirtualSharpie {
+    fn new(reports: mpsc::Sender<Vec<u8>>) -> VirtualSharpie {
+        VirtualSharpie {
+            stream: Vec::new(),
+            decompressor: new_decompressor(&[]),
+            framebuffer: Vec::with_capacity(partial_frame_size(&[RowRange { first: 0, count: ROWS }])),
+            screen: vec![0u8; FRAMESIZE],
+            reports,
+            frames_received: 0,
+            summary: Summary::default(),
+        }
+    }
+
+    /// Take some bytes off the wire, and handle every message that's
+    /// complete.
+    fn receive(&mut self, data: &[u8]) {
+        self.stream.extend_from_slice(data);
+        while self.stream.len() >= HEADER_SIZE {
+            let header = protocol::parse_header(self.stream[..HEADER_SIZE].try_into().unwrap());
+            let message_size = HEADER_SIZE + header.payload_size;
+            if self.stream.len() < message_size {
+                break;
+            }
+            let payload: Vec<u8> = self.stream.drain(..message_size).skip(HEADER_SIZE).collect();
+            self.summary.bytes += message_size as u64;
+            if header.payload_type == Some(PayloadType::Dictionary) {
+                self.load_dictionary(&payload);
+            } else {
+                self.decode_frame(&header, &payload);
+            }
+        }
+    }
+
+    fn load_dictionary(&mut self, dictionary: &[u8]) {
+        if dictionary.len() > MAX_DICTIONARY_SIZE {
+            // the client ignores these, and the frames after it won't
+            // decode
+            println!("loopback: ignoring {} byte dictionary, which is too big",
+                     dictionary.len());
+            return;
+        }
+        self.decompressor = new_decompressor(dictionary);
+        self.summary.dictionaries += 1;
+        // counts start over at every dictionary, and the client says
+        // when it's ready
+        self.frames_received = 0;
+        self.send_report(0, Duration::ZERO);
+    }
+
+    fn decode_frame(&mut self, header: &protocol::Header, payload: &[u8]) {
+        self.frames_received += 1;
+        self.summary.frames += 1;
+        let now = Instant::now();
+        self.summary.first_frame.get_or_insert(now);
+        self.summary.last_frame = Some(now);
+
+        let start = Instant::now();
+        let decoded = expected_frame_size(header).and_then(|expected_size| {
+            self.framebuffer.clear();
+            self.decompressor.decompress_to_buffer(payload, &mut self.framebuffer).ok()?;
+            (self.framebuffer.len() == expected_size).then_some(())
+        });
+        let decode_time = start.elapsed();
+        self.summary.decode_time += decode_time;
+
+        match decoded {
+            Some(()) => apply_frame_to_screen(&self.framebuffer, &header.ranges,
+                                              header.payload_type == Some(PayloadType::DeltaFrame),
+                                              &mut self.screen),
+            None => {
+                // the client drops these quietly, but here's where we
+                // want to hear about it
+                self.summary.bad_frames += 1;
+                println!("loopback: bad frame {} ({:?}, {} bytes)",
+                         self.summary.frames - 1, header, payload.len());
+            }
+        }
+        self.send_report(self.frames_received, decode_time);
+    }
+
+    /// Send a report like status_report_t in the client. There's no
+    /// display, so scanout is always 0.
+    fn send_report(&self, frames_decoded: u32, decode_time: Duration) {
+        let fields = [self.frames_received, frames_decoded,
+                      self.frames_received - frames_decoded,
+                      decode_time.as_micros() as u32, 0];
+        let report = fields.iter().flat_map(|field| field.to_le_bytes()).collect();
+        let _ = self.reports.send(report);
+    }
+}
+
+/// How big a partial frame's stream is (see partial.rs).
+fn partial_frame_size(ranges: &[RowRange]) -> usize {
+    ranges.iter().map(|range| 4 + range.count * ROW_BYTES + ROW_BYTES / 2).sum()
+}
+
+/// What a frame with `header` should decompress to, or None if the
+/// client would throw it out. This is expected_frame_size in the
+/// client.
+fn expected_frame_size(header: &protocol::Header) -> Option<usize> {
+    match header.payload_type {
+        Some(PayloadType::Frame) | Some(PayloadType::DeltaFrame) => (),
+        _ => return None,
+    }
+    if header.payload_size > FRAMESIZE {
+        return None;
+    }
+    if header.range_count == 0 {
+        return Some(FRAMESIZE);
+    }
+    if header.range_count > MAX_RANGES {
+        return None;
+    }
+    let mut next_row = 0;
+    for (i, range) in header.ranges.iter().enumerate() {
+        if range.count == 0 || range.first + range.count > ROWS {
+            return None;
+        }
+        // a partial frame can't skip exactly one row at the top, and
+        // the ranges have to be in order without touching
+        let out_of_order = if i == 0 { range.first == 1 } else { range.first <= next_row };
+        if out_of_order {
+            return None;
+        }
+        next_row = range.first + range.count;
+    }
+    Some(partial_frame_size(&header.ranges))
+}
+
+/// Bring `screen` up to date with a decompressed frame, like
+/// process_band does a band at a time in the client.
+fn apply_frame_to_screen(frame: &[u8], ranges: &[RowRange], delta: bool, screen: &mut [u8]) {
+    let apply = |rows: &[u8], screen_rows: &mut [u8]| {
+        if delta {
+            screen_rows.iter_mut().zip(rows).for_each(|(s, r)| *s ^= r);
+        } else {
+            screen_rows.copy_from_slice(rows);
+        }
+    };
+    if ranges.is_empty() {
+        apply(frame, screen);
+        return;
+    }
+    let mut offset = 0;
+    for range in ranges {
+        // skip the counter in front of the rows
+        offset += 4;
+        let size = range.count * ROW_BYTES;
+        apply(&frame[offset..offset + size],
+              &mut screen[range.first * ROW_BYTES..range.first * ROW_BYTES + size]);
+        // and the zeros after them
+        offset += size + ROW_BYTES / 2;
+    }
+}
@@ -1,12 +1,11 @@
-use std::sync::mpsc;
-use std::thread;
-use std::time::Duration;
-//use std::time::SystemTime;
 use std::fs;
 use std::path::PathBuf;
+use std::str::FromStr;
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::Duration;
 
 use rusb;
-use zstd;
 use anyhow::Error;
 // these seem to be standard abbreviations
 use gstreamer_app as gst_app;
@@ -15,128 +14,275 @@ use gstreamer::prelude::*;
 use glib;
 use clap::Parser;
 
+use sharpie_usb_display_host::{dictionary, encoder, playback};
+use sharpie_usb_display_host::frontend::{InputFrame, InputLayout};
+use sharpie_usb_display_host::container::Container;
+use sharpie_usb_display_host::async_usb::AsyncUsb;
+use sharpie_usb_display_host::loopback::Loopback;
+use sharpie_usb_display_host::transport::Transport;
+use sharpie_usb_display_host::rate::{self, AutoFramerate, Framerate};
+use sharpie_usb_display_host::metrics::{MetricsFormat, MetricsOptions, MetricsWriter};
+
 #[derive(Parser, Debug)]
 #[command(version, about, long_about = None)]
 struct Args {
     /// Path to video to display
-    #[arg(short, long)]
-    video: PathBuf,
+    #[arg(short, long, required_unless_present_any = ["container", "mirror"])]
+    video: Option<PathBuf>,
+    /// Mirror the desktop instead of playing a video. Only the rows
+    /// that change get dithered and sent, and frames go out as soon as
+    /// they're ready instead of on a schedule.
+    #[arg(long, value_enum, conflicts_with_all = ["video", "container", "train_dictionary"])]
+    mirror: Option<MirrorSource>,
+    /// With --mirror x11, the part of the screen to mirror, as
+    /// X,Y,WIDTH,HEIGHT. It gets scaled down to fit. Defaults to the
+    /// whole screen.
+    #[arg(long, requires = "mirror")]
+    mirror_region: Option<Region>,
+    /// With --mirror pipewire, the PipeWire node to capture (the one
+    /// the desktop portal's screen cast hands out). Defaults to
+    /// whatever PipeWire picks.
+    #[arg(long, requires = "mirror")]
+    pipewire_node: Option<String>,
+    /// Play a container made by sharpie-formatter's encode-container
+    /// instead of a video. Nothing gets decoded or encoded, so this
+    /// takes almost no CPU.
+    #[arg(long, conflicts_with_all = ["video", "train_dictionary"])]
+    container: Option<PathBuf>,
+    /// With --container, the frame to start playing at
+    #[arg(long, default_value_t = 0, requires = "container")]
+    start_frame: usize,
+    /// With --container, start over at the beginning when it ends
+    #[arg(long = "loop", default_value_t = false, requires = "container")]
+    looping: bool,
     /// Run without sending data (useful for testing)
     #[arg(short, long, default_value_t = false)]
     no_usb: bool,
+    /// Send frames to a virtual Sharpie in this process instead of a
+    /// real one. It decodes and checks every frame, and prints what it
+    /// saw at the end.
+    #[arg(long, default_value_t = false, conflicts_with = "no_usb")]
+    loopback: bool,
+    /// With --loopback, limit the virtual Sharpie to full-speed USB
+    /// bandwidth, like the real one
+    #[arg(long, default_value_t = false, requires = "loopback")]
+    loopback_full_speed: bool,
+    /// Write to Sharpie with plain blocking USB transfers, one frame at
+    /// a time, instead of keeping several asynchronous ones in flight
+    #[arg(long, default_value_t = false)]
+    sync_usb: bool,
+    /// Have GStreamer scale, rotate, and convert every frame to RGBA
+    /// (like older versions did), instead of doing all of that in one
+    /// pass on the decoder's own YUV frames
+    #[arg(long, default_value_t = false)]
+    gstreamer_scaling: bool,
     /// Framerate to run the video at. Sharpie can't go higher than 21.
-    #[arg(short, long)]
-    framerate: u32,
+    /// "auto" starts at 21, watches how many frames actually make it
+    /// to Sharpie for a few seconds, and stays there if they all did,
+    /// or comes down by the share that got dropped. This is what you
+    /// get without --framerate (which used to be required). With
+    /// --container, "auto" plays at the container's framerate.
+    #[arg(short, long, default_value = "auto")]
+    framerate: Framerate,
+    /// Threads to dither each frame with. More threads cut the time
+    /// each frame takes to dither. Defaults to the number of CPUs, up
+    /// to 4.
+    #[arg(long)]
+    dither_threads: Option<usize>,
+    /// Always send full frames, instead of just the rows that changed
+    #[arg(long, default_value_t = false)]
+    full_frames: bool,
+    /// Send frames as XOR deltas against the frame before them
+    #[arg(long, default_value_t = false)]
+    delta: bool,
+    /// With --delta, send a full keyframe at least this often (in
+    /// frames). Scene cuts get one right away.
+    #[arg(long, default_value_t = 63)]
+    keyframe_interval: u32,
+    /// zstd dictionary to compress frames with (make one with
+    /// --train-dictionary)
+    #[arg(long)]
+    dictionary: Option<PathBuf>,
+    /// Run through the whole video as fast as possible without sending
+    /// anything, and train a zstd dictionary on its frames, written to
+    /// this path
+    #[arg(long, conflicts_with = "dictionary")]
+    train_dictionary: Option<PathBuf>,
+    /// Compress every frame at this zstd level. By default, the level
+    /// changes from frame to frame to keep frames inside what USB can
+    /// carry at --framerate.
+    #[arg(long, value_parser = clap::value_parser!(i32).range(1..=22))]
+    zstd_level: Option<i32>,
+    /// What to do with new frames when dithering falls behind. Block
+    /// (the default for videos) shows every frame, and the drop
+    /// policies keep latency down. --mirror defaults to drop-oldest.
+    #[arg(long, value_enum)]
+    queue_policy: Option<encoder::QueuePolicy>,
+    /// How late (in ms, going by its timestamp) a frame can be when it
+    /// starts dithering before it counts as late. With a drop policy,
+    /// late frames get skipped when there's a newer one.
+    #[arg(long, default_value_t = 100)]
+    max_latency_ms: u64,
+    /// Write per-stage timings, queue depths, fps, frame sizes, and
+    /// drop counts to this file every --metrics-interval-ms ("-" for
+    /// stdout, with --metrics-format json)
+    #[arg(long, conflicts_with = "container")]
+    metrics: Option<PathBuf>,
+    /// With --metrics, json appends a line per interval, and text
+    /// rewrites the file in the Prometheus text format
+    #[arg(long, value_enum, default_value = "json", requires = "metrics")]
+    metrics_format: MetricsFormat,
+    /// With --metrics, how often to write them (in ms)
+    #[arg(long, default_value_t = 1000, requires = "metrics",
+          value_parser = clap::value_parser!(u64).range(1..))]
+    metrics_interval_ms: u64,
 }
 
-    
 
-const FRAMESIZE: usize = 240*320;
-// remember: USB endpoint names are relative to the host
-const SHARPIE_EP_OUT: u8 = 0x01;
-const SHARPIE_VID: u16 = 0x2e8a;
-const SHARPIE_PID: u16 = 0xa1b1;
-
-// for use with 8-bits-per-color data. it might seem excessive to use
-// an i32, but it makes sure that anything we want to do will never overflow
-#[derive(Copy, Clone, Debug, PartialEq)]
-struct RgbPixel {
-    red: i32,
-    green: i32,
-    blue: i32
+/// Where --mirror gets the desktop from.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, clap::ValueEnum)]
+enum MirrorSource {
+    /// an X11 display, with ximagesrc
+    X11,
+    /// a PipeWire screen cast, which is how Wayland desktops share
+    /// their screen
+    Pipewire,
+    /// a test pattern that's mostly standing still, for trying this
+    /// out without a desktop
+    Test,
 }
 
-#[allow(dead_code)]
-impl RgbPixel {
-    fn new() -> RgbPixel {
-        RgbPixel {
-            red: 0,
-            green: 0,
-            blue: 0
-        }
-    }
-
-    /// create a RgbPixel from a ABGR u32 pixel
-    fn from_abgr32_pixel(p: u32) -> RgbPixel {
-        RgbPixel {
-            red: (p & 0xff) as i32,
-            green: ((p >> 8) & 0xff) as i32,
-            blue: ((p >> 16) & 0xff) as i32,
-        }
-    }
+/// A rectangle of the screen, for --mirror-region.
+#[derive(Copy, Clone, Debug)]
+struct Region {
+    x: u32,
+    y: u32,
+    width: u32,
+    height: u32,
+}
 
-    /// create a RgbPixel from RGBA u8 values, but we don't actually
-    /// use the alpha channel.
-    fn from_rgba_u8s(r: u8, g: u8, b: u8, _a: u8) -> RgbPixel {
-        RgbPixel {
-            red: r as i32,
-            green: g as i32,
-            blue: b as i32,
+impl FromStr for Region {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Region, String> {
+        let numbers: Vec<u32> = s.split(',')
+            .map(|n| n.trim().parse::<u32>())
+            .collect::<Result<_, _>>()
+            .map_err(|e| format!("bad region {:?}: {}", s, e))?;
+        match numbers[..] {
+            [x, y, width, height] if width > 0 && height > 0 =>
+                Ok(Region { x, y, width, height }),
+            _ => Err(format!("expected X,Y,WIDTH,HEIGHT, got {:?}", s)),
         }
     }
+}
 
-    /// convert this RgbPixel to 2bpc color, using just the lowest 2
-    /// bits of every field. the array is in RGB order.
-    fn to_2bpc_color_array(&self) -> [u8; 3] {
-        // assuming you made the RgbPixel from the functions
-        // above, there's no need to AND with 0xff.
-        [
-            (self.red >> 6) as u8,
-            (self.green >> 6) as u8,
-            (self.blue >> 6) as u8
-        ]
+/// The front of the pipeline for --mirror.
+fn mirror_source(source: MirrorSource, region: Option<Region>,
+                 pipewire_node: Option<&str>) -> String {
+    match source {
+        // use-damage makes ximagesrc only grab what X says changed,
+        // which is the same idea as the damage tracking in the dither
+        // stage
+        MirrorSource::X11 => {
+            let mut source = String::from("ximagesrc use-damage=true show-pointer=true");
+            if let Some(region) = region {
+                // the end coordinates are inclusive
+                source += &format!(" startx={} starty={} endx={} endy={}",
+                                   region.x, region.y,
+                                   region.x + region.width - 1,
+                                   region.y + region.height - 1);
+            }
+            source
+        },
+        MirrorSource::Pipewire => match pipewire_node {
+            Some(node) => format!("pipewiresrc do-timestamp=true target-object={}", node),
+            None => String::from("pipewiresrc do-timestamp=true"),
+        },
+        // a ball bouncing around on black, which leaves most of the
+        // screen alone every frame like a status display would
+        MirrorSource::Test => String::from("videotestsrc is-live=true pattern=ball"),
     }
+}
 
-    fn color_2bpc_to_8bpc(color_2bit: u8) -> i32 {
-        match color_2bit {
-	    0b00 => 0,
-	    0b01 => 85,
-	    0b10 => 170,
-	    0b11 => 255,
-	    _ => 255,
-        }
-    }
-    
-    /// convert this RgbPixel to 2bpc color, but converted back to
-    /// full range RGB.
-    fn to_2bpc_color_full_range(&self) -> RgbPixel {
-        let this_pixel_2bpc = self.to_2bpc_color_array();
-        RgbPixel {
-            red: RgbPixel::color_2bpc_to_8bpc(this_pixel_2bpc[0]),
-            green: RgbPixel::color_2bpc_to_8bpc(this_pixel_2bpc[1]),
-            blue: RgbPixel::color_2bpc_to_8bpc(this_pixel_2bpc[2]),
-        }
-    }
+const SHARPIE_VID: u16 = 0x2e8a;
+const SHARPIE_PID: u16 = 0xa1b1;
 
-    /// convert this RgbPixel to a 6bpp (2bpc, 6 total bits used) pixel
-    fn to_6bpp_pixel(&self) -> u8 {
-        let px = self.to_2bpc_color_array();
-        px[0] | (px[1] << 2) | (px[2] << 4)
+/// Caps for what comes out of the pipeline at `framerate`: 240x320
+/// RGBA when GStreamer does the scaling, and otherwise whatever size
+/// the video is, in one of the YUV formats the front end reads (see
+/// frontend.rs).
+fn frame_caps(framerate: u32, yuv: bool) -> String {
+    if yuv {
+        format!("video/x-raw,format={{ I420, NV12 }},framerate={}/1", framerate)
+    } else {
+        format!("video/x-raw,width=240,height=320,framerate={}/1,format=RGBA", framerate)
     }
-    
-    fn to_u8_slice(&self) -> [u8; 3] {
-        [self.red as u8, self.green as u8, self.blue as u8]
-    }
-
-    
 }
 
 fn main() -> Result<(), Error> {
     let args = Args::parse();
     gst::init()?;
 
-    let sharpie_usb = 
-        if !args.no_usb {
+    if let Framerate::Fixed(framerate) = args.framerate {
+        if framerate > rate::MAX_FRAMERATE {
+            println!("warning: Sharpie can't keep up with more than {} fps, so frames \
+                      will get dropped", rate::MAX_FRAMERATE);
+        }
+    }
+
+    let loopback = (args.loopback && args.train_dictionary.is_none())
+        .then(|| Arc::new(Loopback::new(args.loopback_full_speed)));
+    let sharpie: Option<Arc<dyn Transport>> = 
+        if let Some(ref loopback) = loopback {
+            Some(loopback.clone())
+        } else if !args.no_usb && args.train_dictionary.is_none() {
             println!("opening USB device");
             // start by trying to open the device
-            Some(rusb::open_device_with_vid_pid(SHARPIE_VID, SHARPIE_PID)
-                .expect("Failed to open Sharpie USB device!"))
+            let handle = rusb::open_device_with_vid_pid(SHARPIE_VID, SHARPIE_PID)
+                .expect("Failed to open Sharpie USB device!");
+            if args.sync_usb {
+                Some(Arc::new(handle))
+            } else {
+                Some(Arc::new(AsyncUsb::new(handle)?))
+            }
         } else {
             None
         };
     
     
-    let input_video = fs::canonicalize(args.video)?;
+    let dictionary = match args.dictionary {
+        Some(ref path) => Some(dictionary::load(path)?),
+        None => None,
+    };
+    // open this now, so a bad path fails before anything starts
+    let metrics = match args.metrics {
+        Some(ref path) => Some(MetricsWriter::open(MetricsOptions {
+            path: path.clone(),
+            format: args.metrics_format,
+            interval: Duration::from_millis(args.metrics_interval_ms),
+        })?),
+        None => None,
+    };
+    
+    if let Some(ref path) = args.container {
+        let container = Container::open(path)?;
+        println!("playing {} frame container (encoded at {} fps)",
+                 container.frame_count(), container.framerate);
+        playback::play(sharpie, &container, playback::PlaybackOptions {
+            start_frame: args.start_frame,
+            looping: args.looping,
+            framerate: match args.framerate {
+                Framerate::Fixed(framerate) => framerate,
+                Framerate::Auto => container.framerate.clamp(1, rate::MAX_FRAMERATE),
+            },
+        });
+        if let Some(loopback) = loopback {
+            loopback.finish();
+        }
+        return Ok(());
+    }
+
     let main_loop = glib::MainLoop::new(None, false);
     // uridecodebin3 works, uridecodebin doesn't. we're using a string
     // launcher instead of manual pipeline assembly because
@@ -159,9 +305,39 @@ fn main() -> Result<(), Error> {
     // the Pipeline has to link clocks and other things to the Element. I
     // don't know why, but I know it works.
     
-    // videoflip needs to come first
+    // when we're training a dictionary, there's no reason to wait for
+    // the clock. when we're mirroring, the source is live, so frames
+    // are already on time when they show up, and waiting on the clock
+    // would just add latency.
+    let sync = args.train_dictionary.is_none() && args.mirror.is_none();
+    // the front end only does video files. desktops come in as RGB
+    // anyway.
+    let yuv = args.mirror.is_none() && !args.gstreamer_scaling;
+    let (source, rate_options, sink_options) = match args.mirror {
+        Some(source) => (
+            mirror_source(source, args.mirror_region, args.pipewire_node.as_deref()),
+            // never make up frames, and only ever hold on to the
+            // newest one
+            " drop-only=true",
+            " max-buffers=1 drop=true",
+        ),
+        None => {
+            let input_video = fs::canonicalize(args.video.unwrap())?;
+            (format!("uridecodebin3 uri=file://{}", input_video.to_str().unwrap()), "", "")
+        },
+    };
+    // videoflip needs to come first. with the front end, videoconvert
+    // only does anything when the decoder doesn't put out I420 or NV12
+    // already. the caps go in a named capsfilter so that auto
+    // framerate can change them later (and videorate follows along).
+    let initial_framerate = args.framerate.initial();
+    let convert = if yuv {
+        format!("videoconvert ! videorate{}", rate_options)
+    } else {
+        format!("videoflip method=clockwise ! videoconvert ! videorate{} ! videoscale", rate_options)
+    };
     let launched_bin = gst::parse::launch(
-        &format!("uridecodebin3 uri=file://{} ! videoflip method=clockwise ! videoconvert ! videorate ! videoscale ! video/x-raw,width=240,height=320,framerate=21/1,format=RGBA ! appsink name=sink emit-signals=True", input_video.to_str().unwrap())
+        &format!("{} ! {} ! capsfilter name=rate caps=\"{}\" ! appsink name=sink emit-signals=True sync={}{}", source, convert, frame_caps(initial_framerate, yuv), sync, sink_options)
     )?;
     // note that getting 20 fps above requires running the RP2350 at
     // 200 MHz. see the sharpie-usb-display README.md for more info
@@ -170,6 +346,7 @@ fn main() -> Result<(), Error> {
     pipeline.add(&launched_bin)?;
     // get access to the appsink so we can listen for its signals
     let appsink = pipeline.by_name("sink").unwrap();
+    let rate_filter = pipeline.by_name("rate").unwrap();
     
 
     // adding an audio sink means reworking the entire pipeline and
@@ -179,127 +356,67 @@ fn main() -> Result<(), Error> {
     // what its sources look like until it processes the file
     
 
-    let (tx, rx) = mpsc::channel();
-    let mut count = 0;
-    // have to move the rx handle and the device
-    thread::spawn(move || {
-        let mut first_frame_processed = false;
-
-	/*
-	// these variables get set to actually useful values below,
-	// but the compiler doesn't like it if they haven't already
-	// been initialized (despite the fact that the loop logic
-	// below means that they will never be uninitialized at time
-	// of usage)
-        let mut last_frame: Vec<RgbPixel> = Vec::new();
-        let mut last_dithered_frame: Vec<RgbPixel> = Vec::new();*/
-	
-        loop {
-            // if the other thread dies (because the GStreamer main
-            // loop exists), the receiver here loses its link and
-            // throws an error.
-            let received: Result<Vec<RgbPixel>, _> = rx.recv();
-            if let Ok(frame_rgbpixel) = received {
-                //let mut start = SystemTime::now();
-
-		// this was a cool experiment(tm) to reduce flicker
-		// that doesn't really work, under the assumption that
-		// dithering caused most pixels between similar frames
-		// to change---it just causes color banding and
-		// doesn't actually dither enough. I think that's
-		// because the diffuse-error-into-this-frame approach
-		// that dithering uses doesn't quite work with frame
-		// deltas.
-                /*let dithered =
-                    if !first_frame_processed {
-                        // if we haven't processed any frames yet, all
-                        // we have to do is dither this frame
-                        first_frame_processed = true;
-                        floyd_steinberg_dither(&frame_rgbpixel)
-                    } else {
-                        // if we have a previous frame, do a
-                        // differential dither
-                        floyd_steinberg_difference_dither(
-                            &last_dithered_frame,
-                            &last_frame,
-                            &frame_rgbpixel)
-                    };
-		*/
-                let dithered = floyd_steinberg_dither(&frame_rgbpixel);
-                /*let mut end = SystemTime::now();
-                
-                let mut duration = end.duration_since(start).unwrap();
-                println!("dithering took {:?}", duration);*/
-
-                //start = SystemTime::now();
-                let formatted = format_image(&dithered);
-                /*end = SystemTime::now();
-                duration = end.duration_since(start).unwrap();
-                println!("formatting took {:?}", duration);*/
-
-		// we reach diminishing returns (~50-100 bytes saved
-		// per one compression level increase) after level 6
-		// fairly consistently. zstd benchmark puts level 6 at
-		// ~70MB/s, which is plenty fast.
-                let mut compressed = zstd::encode_all(&formatted[..], 6).unwrap();
-
-                // append the length of the compressed data to the
-                // start as a little-endian u32. zstd includes the
-                // decompressed length in its frame format but Sharpie
-                // needs to know how much to read on the fly.
-                compressed.splice(0..0, u32::to_le_bytes(compressed.len() as u32));
-                
-                // if we're in no_usb mode, we don't need to write to the device
-                if let Some(ref usb_device) = sharpie_usb {
-                    usb_device.write_bulk(
-                        SHARPIE_EP_OUT,
-                        &compressed,
-                        // 1000 ms timeout is plenty
-                        Duration::from_millis(1000)).unwrap();
-                }
-                println!("wrote frame {}, size = {}", count, compressed.len());
-
-                //last_dithered_frame = dithered;
-                //last_frame = frame_rgbpixel;
-
-                count += 1;
-            } else {
-                println!("main loop disconnected");
-                // leave the thread
-                break;
-            }
-            
-        }
+    // frames go from the appsink into the staged encoder, which does
+    // everything else (see encoder.rs)
+    let dither_threads = args.dither_threads.unwrap_or_else(|| {
+        thread::available_parallelism().map_or(1, |n| n.get().min(4))
+    });
+    // when training a dictionary, frames don't get dropped, so there's
+    // nothing to measure
+    let auto_framerate = Mutex::new((args.framerate == Framerate::Auto
+                                     && args.train_dictionary.is_none())
+                                    .then(AutoFramerate::new));
+    let (tx, encoder) = encoder::spawn(sharpie, encoder::EncoderOptions {
+        dither_threads,
+        partial_updates: !args.full_frames,
+        delta: args.delta,
+        keyframe_interval: args.keyframe_interval,
+        dictionary,
+        train_dictionary: args.train_dictionary,
+        framerate: initial_framerate,
+        zstd_level: args.zstd_level,
+        // for a desktop, the newest frame is the only one worth
+        // showing
+        queue_policy: args.queue_policy.unwrap_or(match args.mirror {
+            Some(_) => encoder::QueuePolicy::DropOldest,
+            None => encoder::QueuePolicy::Block,
+        }),
+        max_latency: Duration::from_millis(args.max_latency_ms),
+        damage_tracking: args.mirror.is_some(),
+        metrics,
     });
+    let feedback = encoder.feedback();
     
-    appsink.connect("new-sample",
+    let new_sample_handler = appsink.connect("new-sample",
         true, // "after"
         move |arg| {
             
             let aps = arg[0].get::<gst_app::AppSink>().unwrap();
             let sample = aps.pull_sample().unwrap();
-            let buffer = sample.buffer().unwrap();
-            let map = buffer.map_readable().unwrap();
-
-            // the data in the vec is a 240x320 RGBA image (4 bytes
-            // per pixel in RGBA order), but it's in bytes, which
-            // makes iteration a lot harder. let's convert it to
-            // something really convenient, which will also be on the
-            // heap to make sending easier. we do this here because
-            // the map is local to this closure.
+            // the buffer is reference counted, so sending it to the
+            // encoder doesn't copy any pixel data. the dither stage
+            // maps it and dithers directly from it. this used to unpack every
+            // pixel into a big Vec of i32 channels (~920 KB per
+            // frame) right here.
+            let buffer = sample.buffer_owned().unwrap();
+            let layout = match InputLayout::from_sample(&sample, &buffer) {
+                Some(layout) if layout.fits(buffer.size()) => layout,
+                _ => {
+                    println!("dropping buffer we can't read ({} bytes)", buffer.size());
+                    return Some(gst::FlowReturn::Ok.into());
+                }
+            };
 
-            // this takes like 3 ms in debug mode and ~400 us in release
-            let data = map.as_slice();
-            let mut frame_rgbpixel: Vec<RgbPixel> =
-                Vec::with_capacity(FRAMESIZE);
+            tx.send(InputFrame { buffer, layout }).unwrap();
 
-            for i in (0..data.len()).step_by(4) {
-                frame_rgbpixel.push(RgbPixel::from_rgba_u8s(
-                    data[i], data[i+1], data[i+2], data[i+3]));
+            if let Some(framerate) = auto_framerate.lock().unwrap().as_mut()
+                .and_then(|auto| auto.frame(feedback.dropped())) {
+                println!("auto framerate: settling on {} fps", framerate);
+                feedback.set_framerate(framerate);
+                let caps: gst::Caps = frame_caps(framerate, yuv).parse().unwrap();
+                rate_filter.set_property("caps", caps);
             }
             
-            tx.send(frame_rgbpixel).unwrap();
-            
             
             Some(gst::FlowReturn::Ok.into())
         }
@@ -341,240 +458,15 @@ fn main() -> Result<(), Error> {
 
     println!("after mainloop");
     pipeline.set_state(gst::State::Null)?;
-    
-    Ok(())
-}
-
-// this is an adaptation of the dithering code in sharpie-formatter to
-// work with straight ABGR u32s and assume that images are 240x320.
-fn rgb8_quant_error(pixel: RgbPixel, difference: [i32; 3], quant_num: i32) -> RgbPixel {
-    // we have to clamp overflows to 255 with a saturating signed add,
-    // otherwise channels that saturate will underflow, causing (for
-    // example) some bright white pixels in the original image to
-    // appear as a full blue pixel in the dithered output. the max
-    // difference is +/- 63 and quant_num is always less than 16, so
-    // we can safely cast to i8 without losing anything.
-    
-    let pixel_as_u8 = pixel.to_u8_slice();
 
-    RgbPixel {
-        red: pixel_as_u8[0].saturating_add_signed((difference[0] * quant_num/16) as i8) as i32,
-        green: pixel_as_u8[1].saturating_add_signed((difference[1] * quant_num/16) as i8) as i32,
-        blue: pixel_as_u8[2].saturating_add_signed((difference[2] * quant_num/16) as i8) as i32,
+    // dropping the handler drops its sender, which lets the encoder
+    // stages run out and stop (and write out a trained dictionary, if
+    // we're doing that)
+    appsink.disconnect(new_sample_handler);
+    encoder.finish();
+    if let Some(loopback) = loopback {
+        loopback.finish();
     }
-}
-
-/*
-/// Dither an image, but only on the pixels that have changed relative
-/// to `lastframe`. `lastframe` should be a dithered frame.
-fn floyd_steinberg_difference_dither(
-    last_dithered_frame: &[RgbPixel],
-    last_frame: &[RgbPixel],
-    this_frame: &[RgbPixel]) -> Vec<RgbPixel> {
     
-    let mut dithered_frame: Vec<RgbPixel> = last_dithered_frame.into();
-    
-    for y in 0..320 {
-	for x in 0..240 {
-	    // for each pixel, get its color channels, then convert
-	    // it to 2bpc and calculate the quantization error.
-	    let pixel = this_frame[y*240 + x];
-            if pixel != last_frame[y*240 + x] {
-                // if the non-dithered pixels at the same position
-                // between this frame and the last frame are
-                // different, quantize the new one and distribute its
-                // error
-                
-	        let pixel_color_reduced = pixel.to_2bpc_color_full_range();
-	        // make an 8bpc version of the new pixel to put back in
-	        // the original image, where we keep the initial state and
-	        // diffused error (which gets transformed into a dithered
-	        // image in 8bpc format)
-	        
-	        // RgbPixel components are i32, so there's no risk of
-	        // overflow on numbers that are 255 at most
-	        let quant_error: [i32; 3] = [
-                    pixel.red - pixel_color_reduced.red,
-                    pixel.green - pixel_color_reduced.green,
-                    pixel.blue - pixel_color_reduced.blue
-                ];
-                
-	        // put the quantized pixel back into the original image
-	        dithered_frame[y*240 + x] = pixel_color_reduced;
-                
-	        // and then diffuse the error over adjacent pixels
-	        
-	        // if we're in a position that would write to pixels outside the image,
-	        // just don't write them.
-	        if x + 1 < 240 {
-		    dithered_frame[y * 240 + (x + 1)] = 
-			rgb8_quant_error(this_frame[y * 240 + (x + 1)],
-					 quant_error, 7);
-	        }
-                
-	        if x != 0 && y + 1 < 320 {
-                    dithered_frame[(y + 1)*240 + (x - 1)] = 
-			rgb8_quant_error(this_frame[(y + 1) * 240 + (x - 1)],
-					 quant_error, 3);
-	        }
-                
-	        if y + 1 < 320 {
-                    dithered_frame[(y + 1)*240 + x] = 
-			rgb8_quant_error(this_frame[(y + 1) * 240 + x],
-					 quant_error, 5);
-	        }
-                
-	        if x + 1 < 240 && y + 1 < 320 {
-                    dithered_frame[(y + 1)*240 + (x + 1)] = 
-			rgb8_quant_error(this_frame[(y + 1) * 240 + (x + 1)],
-					 quant_error, 1);
-	        }
-            }
-        }
-
-    }
-
-    dithered_frame
-
-}
-
-*/
-// this function would appear to take the bulk of the time during a
-// frame. the dithering itself also looks slightly different from the
-// manual (ffmpeg->shell scripts/sharpie-formatter) frames, but that
-// might be an effect of GStreamer's decoding.
-
-/// Floyd-Steinberg dither an image (a 240x320 array of RgbPixels) to
-/// another array of the same type.
-fn floyd_steinberg_dither(input: &[RgbPixel]) -> Vec<RgbPixel> {
-    let mut dithered_image: Vec<RgbPixel> = input.into();
-    
-    for y in 0..320 {
-	for x in 0..240 {
-	    // for each pixel, get its color channels, then convert
-	    // it to 2bpc and calculate the quantization error.
-	    let pixel = dithered_image[y*240 + x];
-	    let pixel_color_reduced = pixel.to_2bpc_color_full_range();
-	    // make an 8bpc version of the new pixel to put back in
-	    // the original image, where we keep the initial state and
-	    // diffused error (which gets transformed into a dithered
-	    // image in 8bpc format)
-	    
-	    // RgbPixel components are i32, so there's no risk of
-	    // overflow on numbers that are 255 at most
-	    let quant_error: [i32; 3] = [
-                pixel.red - pixel_color_reduced.red,
-                pixel.green - pixel_color_reduced.green,
-                pixel.blue - pixel_color_reduced.blue
-            ];
-            
-	    // put the quantized pixel back into the original image
-	    dithered_image[y*240 + x] = pixel_color_reduced;
-
-	    // and then diffuse the error over adjacent pixels
-	    
-	    // if we're in a position that would write to pixels outside the image,
-	    // just don't write them.
-	    if x + 1 < 240 {
-		dithered_image[y * 240 + (x + 1)] = 
-		    rgb8_quant_error(dithered_image[y * 240 + (x + 1)],
-				     quant_error, 7);
-	    }
-
-	    if x != 0 && y + 1 < 320 {
-                dithered_image[(y + 1)*240 + (x - 1)] = 
-		    rgb8_quant_error(dithered_image[(y + 1) * 240 + (x - 1)],
-				     quant_error, 3);
-	    }
-
-	    if y + 1 < 320 {
-                dithered_image[(y + 1)*240 + x] = 
-		    rgb8_quant_error(dithered_image[(y + 1) * 240 + x],
-				     quant_error, 5);
-	    }
-
-	    if x + 1 < 240 && y + 1 < 320 {
-                dithered_image[(y + 1)*240 + (x + 1)] = 
-		    rgb8_quant_error(dithered_image[(y + 1) * 240 + (x + 1)],
-				     quant_error, 1);
-	    }
-	}
-
-    }
-
-    dithered_image
-}
-
-// this is code directly from sharpie-formatter, which probably means
-// it should be an importable crate
-
-/// Convert two pixels in 0bBBGGRR format to their respective MSb and
-/// LSb bytes.
-fn two_pixels_to_msb_lsb(p1: u8, p2: u8) -> (u8, u8) {
-    // apply a linear mapping from 24-bit color to 6-bit color
-    let p1red = p1 & 0b11;
-    let p1green = (p1 & 0b1100) >> 2;
-    let p1blue = (p1 & 0b110000) >> 4;
-    let p2red = p2 & 0b11;
-    let p2green = (p2 & 0b1100) >> 2;
-    let p2blue = (p2 & 0b110000) >> 4;
-
-    // get the MSbs of both pixels, each of these values is 0
-    // or 1
-    let p1red_m = p1red >> 1;
-    let p1green_m = p1green >> 1;
-    let p1blue_m = p1blue >> 1;
-    let p2red_m = p2red >> 1;
-    let p2green_m = p2green >> 1;
-    let p2blue_m = p2blue >> 1;
-
-    // assemble the MSb byte: the second pixel goes in the higher
-    // position while the first goes in the lower (this was wrong
-    // before)
-    let msb = (p2blue_m << 5) | (p2green_m << 3) | (p2red_m << 1)
-	| (p1blue_m << 4) | (p1green_m << 2) | (p1red_m);
-    
-    // now find LSBs from both pixels
-    let p1red_l = p1red & 1;
-    let p1green_l = p1green & 1;
-    let p1blue_l = p1blue & 1;
-    let p2red_l = p2red & 1;
-    let p2green_l = p2green & 1;
-    let p2blue_l = p2blue & 1;
-    
-    // and write to formatted array as LSBs in 0bB1B2G1G2R1R2
-    let lsb = (p2blue_l << 5) | (p2green_l << 3) | (p2red_l << 1)
-	| (p1blue_l << 4) | (p1green_l << 2) | (p1red_l);
-
-    (msb, lsb)
-}
-
-// this is taken from sharpie-formatter but lightly adjusted to work
-// with a flat slice of u32s in ABGR format (generated from the
-// callback above)
-fn format_image(img: &[RgbPixel]) -> [u8; FRAMESIZE] {
-    // formatted image buffer
-    let mut formatted: [u8; FRAMESIZE] = [0u8; FRAMESIZE];
-    
-    for y in 0..320 {
-        // take the input two pixels at a time
-	for x in 0..120 {
-	    //println!("y: {}, x: {}, formatted_index: {}", y, x, formatted_index);
-            
-	    // get pixels
-            let p1 = &img[y*240 + x*2];
-            let p2 = &img[y*240 + x*2 + 1];
-
-            let p1_2bpc = p1.to_6bpp_pixel();
-            let p2_2bpc = p2.to_6bpp_pixel();
-            
-            // names: byte of most significant bits of colors, byte of
-            // least significant bits of colors
-	    let (msb_byte, lsb_byte) = two_pixels_to_msb_lsb(p1_2bpc, p2_2bpc);
-
-            formatted[y * 240 + x] = msb_byte;
-            formatted[y * 240 + x + 120] = lsb_byte;
-	}
-    }
-    formatted
+    Ok(())
 }
@@ -0,0 +1,285 @@
+// Metrics for the streaming pipeline, written out every so often while
+// it runs (with --metrics), so it's possible to see where each frame's
+// time goes on a real setup without adding println!s and recompiling.
+//
+// Every stage records how long each frame took it in a histogram, and
+// every interval the encoder takes the histograms (which resets them),
+// adds queue depths, fps, frame sizes, and drop counts, and writes all
+// of it out as either a JSON line (appended, one per interval) or a
+// text file in the Prometheus text format (rewritten every interval,
+// for node_exporter's textfile collector or just `watch cat`).
+
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, Write};
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+/// Histogram buckets per power of two, which puts bucket edges about
+/// 19% apart.
+const BUCKETS_PER_OCTAVE: f64 = 4.0;
+/// Enough buckets to go up to 2^25 µs (over 30 s).
+const BUCKETS: usize = 100;
+
+/// How to write metrics out.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, clap::ValueEnum)]
+pub enum MetricsFormat {
+    /// a JSON object per line, one line per interval
+    Json,
+    /// Prometheus text format, rewritten every interval
+    Text,
+}
+
+pub struct MetricsOptions {
+    /// where to write, or "-" for stdout (JSON only)
+    pub path: PathBuf,
+    pub format: MetricsFormat,
+    pub interval: Duration,
+}
+
+/// A histogram of durations that any thread can record into without
+/// locking.
+pub struct Histogram {
+    buckets: [AtomicU64; BUCKETS],
+    sum_ns: AtomicU64,
+    max_ns: AtomicU64,
+}
+
+impl Default for Histogram {
+    fn default() -> Histogram {
+        Histogram {
+            buckets: std::array::from_fn(|_| AtomicU64::new(0)),
+            sum_ns: AtomicU64::new(0),
+            max_ns: AtomicU64::new(0),
+        }
+    }
+}
+
+/// Counts and percentiles out of a histogram, in microseconds.
+#[derive(Default, Debug)]
+pub struct Summary {
+    pub count: u64,
+    pub mean_us: f64,
+    pub p50_us: f64,
+    pub p90_us: f64,
+    pub p99_us: f64,
+    pub max_us: f64,
+}
+
+impl Histogram {
+    pub fn record(&self, time: Duration) {
+        let us = time.as_secs_f64() * 1e6;
+        let bucket = ((us + 1.0).log2() * BUCKETS_PER_OCTAVE) as usize;
+        self.buckets[bucket.min(BUCKETS - 1)].fetch_add(1, Ordering::Relaxed);
+        let ns = time.as_nanos() as u64;
+        self.sum_ns.fetch_add(ns, Ordering::Relaxed);
+        self.max_ns.fetch_max(ns, Ordering::Relaxed);
+    }
+
+    /// Summarize everything recorded since the last take, and start
+    /// over. A frame recorded while this runs might land in either
+    /// interval, which doesn't matter for metrics.
+    pub fn take(&self) -> Summary {
+        let counts: Vec<u64> = self.buckets.iter().map(|b| b.swap(0, Ordering::Relaxed)).collect();
+        let sum_ns = self.sum_ns.swap(0, Ordering::Relaxed);
+        let max_us = self.max_ns.swap(0, Ordering::Relaxed) as f64 / 1000.0;
+        let count: u64 = counts.iter().sum();
+        if count == 0 {
+            return Summary::default();
+        }
+
+        // the top of the bucket the percentile lands in, which is never
+        // more than the biggest time actually recorded
+        let percentile = |p: f64| {
+            let target = (count as f64 * p).ceil() as u64;
+            let mut seen = 0;
+            for (bucket, &n) in counts.iter().enumerate() {
+                seen += n;
+                if seen >= target {
+                    let top = 2f64.powf((bucket + 1) as f64 / BUCKETS_PER_OCTAVE) - 1.0;
+                    return top.min(max_us);
+                }
+            }
+            max_us
+        };
+        Summary {
+            count,
+            mean_us: sum_ns as f64 / count as f64 / 1000.0,
+            p50_us: percentile(0.5),
+            p90_us: percentile(0.9),
+            p99_us: percentile(0.99),
+            max_us,
+        }
+    }
+}
+
+/// Counters that aren't any one stage's, shared between the stages and
+/// whoever writes the metrics.
+#[derive(Default)]
+pub struct Counters {
+    /// frames written to Sharpie
+    pub frames: AtomicU64,
+    pub bytes: AtomicU64,
+    /// biggest frame since the last report
+    pub max_frame_bytes: AtomicU64,
+    /// frames that didn't change, so didn't get sent
+    pub unchanged: AtomicU64,
+    /// time the appsink callback spends handing a frame over
+    pub ingest: Histogram,
+    /// time the front end spends on a YUV frame (see frontend.rs)
+    pub convert: Histogram,
+    /// from the appsink to done writing to Sharpie
+    pub latency: Histogram,
+}
+
+pub struct StageReport {
+    pub name: &'static str,
+    pub times: Summary,
+    /// share of the interval the stage spent working
+    pub busy: f64,
+    /// frames waiting in front of it, for the stages with a queue
+    pub queued: Option<usize>,
+}
+
+/// Everything written out for one interval.
+pub struct Report {
+    /// since the encoder started
+    pub elapsed: Duration,
+    pub interval: Duration,
+    pub frames: u64,
+    pub bytes: u64,
+    pub max_frame_bytes: u64,
+    pub stages: Vec<StageReport>,
+    pub latency: Summary,
+    pub framerate: u32,
+    pub zstd_level: i32,
+    /// these are totals since the start
+    pub dropped_queue: u64,
+    pub late: u64,
+    pub dropped_sharpie: u64,
+    pub unchanged: u64,
+    /// decode µs, scanout µs, and full buffers, from Sharpie's last
+    /// status report
+    pub sharpie: Option<(u32, u32, u32)>,
+}
+
+fn summary_json(summary: &Summary) -> String {
+    format!("{{\"count\":{},\"mean_us\":{:.1},\"p50_us\":{:.1},\"p90_us\":{:.1},\
+             \"p99_us\":{:.1},\"max_us\":{:.1}}}",
+            summary.count, summary.mean_us, summary.p50_us, summary.p90_us,
+            summary.p99_us, summary.max_us)
+}
+
+impl Report {
+    fn fps(&self) -> f64 {
+        self.frames as f64 / self.interval.as_secs_f64()
+    }
+
+    fn bytes_per_frame(&self) -> f64 {
+        if self.frames == 0 { 0.0 } else { self.bytes as f64 / self.frames as f64 }
+    }
+
+    pub fn to_json(&self) -> String {
+        let stages: Vec<String> = self.stages.iter().map(|stage| {
+            let times = summary_json(&stage.times);
+            let queued = stage.queued.map_or(String::from("null"), |queued| queued.to_string());
+            format!("\"{}\":{{\"busy\":{:.3},\"queued\":{},\"times\":{}}}",
+                    stage.name, stage.busy, queued, times)
+        }).collect();
+        let sharpie = match self.sharpie {
+            Some((decode_us, scanout_us, buffers_full)) =>
+                format!("{{\"decode_us\":{},\"scanout_us\":{},\"buffers_full\":{}}}",
+                        decode_us, scanout_us, buffers_full),
+            None => String::from("null"),
+        };
+        format!("{{\"elapsed_s\":{:.3},\"interval_s\":{:.3},\"frames\":{},\"fps\":{:.2},\
+                 \"bytes\":{},\"bytes_per_frame\":{:.0},\"max_frame_bytes\":{},\
+                 \"framerate\":{},\"zstd_level\":{},\"stages\":{{{}}},\"latency\":{},\
+                 \"dropped\":{{\"queue\":{},\"late\":{},\"sharpie\":{}}},\"unchanged\":{},\
+                 \"sharpie\":{}}}",
+                self.elapsed.as_secs_f64(), self.interval.as_secs_f64(), self.frames,
+                self.fps(), self.bytes, self.bytes_per_frame(), self.max_frame_bytes,
+                self.framerate, self.zstd_level, stages.join(","), summary_json(&self.latency),
+                self.dropped_queue, self.late, self.dropped_sharpie, self.unchanged, sharpie)
+    }
+
+    pub fn to_text(&self) -> String {
+        let mut text = String::new();
+        let mut line = |name: &str, labels: &str, value: f64| {
+            text += &format!("sharpie_{}{} {}\n", name, labels, value);
+        };
+        line("elapsed_seconds", "", self.elapsed.as_secs_f64());
+        line("fps", "", self.fps());
+        line("framerate", "", self.framerate as f64);
+        line("bytes_per_frame", "", self.bytes_per_frame());
+        line("max_frame_bytes", "", self.max_frame_bytes as f64);
+        line("zstd_level", "", self.zstd_level as f64);
+        line("frames_dropped_total", "{reason=\"queue\"}", self.dropped_queue as f64);
+        line("frames_dropped_total", "{reason=\"sharpie\"}", self.dropped_sharpie as f64);
+        line("frames_late_total", "", self.late as f64);
+        line("frames_unchanged_total", "", self.unchanged as f64);
+        let times = self.stages.iter().map(|stage| (stage.name, &stage.times))
+            .chain([("latency", &self.latency)]);
+        for (name, summary) in times {
+            let labels = |quantile: &str| format!("{{stage=\"{}\",quantile=\"{}\"}}", name, quantile);
+            line("stage_microseconds", &labels("0.5"), summary.p50_us);
+            line("stage_microseconds", &labels("0.9"), summary.p90_us);
+            line("stage_microseconds", &labels("0.99"), summary.p99_us);
+            line("stage_microseconds", &labels("1"), summary.max_us);
+        }
+        for stage in &self.stages {
+            let labels = format!("{{stage=\"{}\"}}", stage.name);
+            line("stage_busy_ratio", &labels, stage.busy);
+            if let Some(queued) = stage.queued {
+                line("stage_queued", &labels, queued as f64);
+            }
+        }
+        if let Some((decode_us, scanout_us, buffers_full)) = self.sharpie {
+            line("device_decode_microseconds", "", decode_us as f64);
+            line("device_scanout_microseconds", "", scanout_us as f64);
+            line("device_buffers_full", "", buffers_full as f64);
+        }
+        text
+    }
+}
+
+/// Writes reports where --metrics said to.
+pub struct MetricsWriter {
+    options: MetricsOptions,
+    /// JSON lines go here. text files get rewritten every time instead.
+    out: Option<Box<dyn Write + Send>>,
+}
+
+impl MetricsWriter {
+    pub fn open(options: MetricsOptions) -> io::Result<MetricsWriter> {
+        let out: Option<Box<dyn Write + Send>> = match options.format {
+            MetricsFormat::Json if options.path.as_os_str() == "-" => Some(Box::new(io::stdout())),
+            MetricsFormat::Json => Some(Box::new(
+                OpenOptions::new().create(true).append(true).open(&options.path)?)),
+            MetricsFormat::Text if options.path.as_os_str() == "-" => return Err(io::Error::new(
+                io::ErrorKind::InvalidInput, "text metrics have to go to a file")),
+            MetricsFormat::Text => None,
+        };
+        Ok(MetricsWriter { options, out })
+    }
+
+    pub fn interval(&self) -> Duration {
+        self.options.interval
+    }
+
+    pub fn write(&mut self, report: &Report) -> io::Result<()> {
+        match self.out {
+            Some(ref mut out) => {
+                writeln!(out, "{}", report.to_json())?;
+                out.flush()
+            },
+            None => {
+                // write it all somewhere else first, so nothing ever
+                // reads half a file
+                let temp = self.options.path.with_extension("tmp");
+                File::create(&temp)?.write_all(report.to_text().as_bytes())?;
+                fs::rename(temp, &self.options.path)
+            },
+        }
+    }
+}
@@ -0,0 +1,111 @@
+// Partial updates. Sharpie's display can skip over lines it doesn't
+// need to rewrite (a skipped line takes 1/16 of the time of a written
+// one), so when only part of a frame changes, we send just the rows
+// that changed and let the client drive the partial-update PIOs (see
+// sharpie-sw/main.c, where they were first worked out).
+//
+// The ranges go in the frame's header (see protocol.rs). For a full
+// frame, the zstd data decompresses to a formatted frame, like it
+// always has. For a partial frame, it decompresses to exactly what
+// the client's partial horiz/data state machine wants DMAed into it,
+// which for every range is
+//
+//   u32 (row count * 2)
+//   row count * 240 bytes of formatted rows
+//   120 bytes of zeros
+//
+// building that here means the client can decompress straight into
+// the buffer it DMAs out of. The counters and zeros compress down to
+// almost nothing.
+
+use sharpie_core::format::FRAMESIZE;
+
+/// Bytes in one formatted row.
+pub const ROW_BYTES: usize = 240;
+pub const ROWS: usize = FRAMESIZE / ROW_BYTES;
+
+/// The most row ranges the client takes in one frame. This has to
+/// match MAX_PARTIAL_RANGES in the client.
+pub const MAX_RANGES: usize = 8;
+
+/// Past this many changed rows, we just send a full frame. A partial
+/// frame that writes almost every row doesn't save any panel time, and
+/// the full-frame path is the well-trodden one.
+pub const PARTIAL_MAX_ROWS: usize = ROWS * 3 / 4;
+
+/// A run of changed rows.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub struct RowRange {
+    pub first: usize,
+    pub count: usize,
+}
+
+impl RowRange {
+    fn end(&self) -> usize {
+        self.first + self.count
+    }
+}
+
+/// Find the rows that differ between two formatted frames, as at most
+/// MAX_RANGES sorted, non-touching ranges. Returns an empty Vec if the
+/// frames are the same.
+pub fn dirty_ranges(prev: &[u8], next: &[u8]) -> Vec<RowRange> {
+    assert_eq!(prev.len(), FRAMESIZE);
+    assert_eq!(next.len(), FRAMESIZE);
+
+    let mut ranges: Vec<RowRange> = Vec::new();
+    for (row, (p, n)) in prev.chunks_exact(ROW_BYTES)
+        .zip(next.chunks_exact(ROW_BYTES)).enumerate() {
+        if p == n {
+            continue;
+        }
+        match ranges.last_mut() {
+            Some(last) if last.end() == row => last.count += 1,
+            _ => ranges.push(RowRange { first: row, count: 1 }),
+        }
+    }
+
+    // every range costs a GCK control word pair, a counter, and a
+    // half-line of zeros, and the client only has room for so many,
+    // so fold the ranges with the smallest gaps between them together
+    // until they fit. rewriting a couple of unchanged rows is
+    // harmless.
+    while ranges.len() > MAX_RANGES {
+        let i = (0..ranges.len() - 1)
+            .min_by_key(|&i| ranges[i + 1].first - ranges[i].end())
+            .unwrap();
+        let next = ranges.remove(i + 1);
+        ranges[i].count = next.end() - ranges[i].first;
+    }
+
+    // the GCK state machine takes a first skip count of 0 (which is
+    // "1 line" after the -1) to mean "start at the top", so skipping
+    // exactly one line can't be done. rewrite row 0 instead.
+    if let Some(first) = ranges.first_mut() {
+        if first.first == 1 {
+            first.first = 0;
+            first.count += 1;
+        }
+    }
+
+    ranges
+}
+
+/// Total rows covered by `ranges`.
+pub fn range_rows(ranges: &[RowRange]) -> usize {
+    ranges.iter().map(|r| r.count).sum()
+}
+
+/// Build the partial horiz/data stream for `ranges` of `frame` into
+/// `out` (see the top of this file).
+pub fn build_partial_stream(frame: &[u8], ranges: &[RowRange], out: &mut Vec<u8>) {
+    out.clear();
+    for range in ranges {
+        // *2 because every row is two GCK h/ls (MSbs, then LSbs)
+        out.extend_from_slice(&u32::to_le_bytes(range.count as u32 * 2));
+        out.extend_from_slice(&frame[range.first * ROW_BYTES..range.end() * ROW_BYTES]);
+        // the extra h/l at the end of a changed section has its data
+        // lines held at zero
+        out.resize(out.len() + ROW_BYTES / 2, 0);
+    }
+}
@@ -0,0 +1,84 @@
+// Plays a pre-encoded container (see container.rs). There's nothing
+// to decode, dither, or compress, so this is just a loop that sends
+// the next frame from the memory map when it's due, with the same flow
+// control as the encoder (see credits.rs): when Sharpie is behind, the
+// frame gets skipped, and since every frame in a container is a full
+// frame, the one after it shows up just fine.
+
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, Instant};
+
+use crate::container::Container;
+use crate::credits::{self, Credits};
+use crate::protocol;
+use crate::transport::Transport;
+
+/// Print progress every this many frames.
+const REPORT_INTERVAL: u64 = 100;
+
+pub struct PlaybackOptions {
+    /// frame to start at
+    pub start_frame: usize,
+    /// go back to the start when we get to the end, forever
+    pub looping: bool,
+    pub framerate: u32,
+}
+
+pub fn play(sharpie: Option<Arc<dyn Transport>>, container: &Container,
+            options: PlaybackOptions) {
+    let credits = Credits::new();
+    let reader = sharpie.as_ref().map(|sharpie| {
+        let reader = credits::spawn_reader(sharpie.clone(), credits.clone());
+        println!("sending {} byte dictionary", container.dictionary().len());
+        sharpie.write(&protocol::dictionary_message(container.dictionary()),
+                      Duration::from_millis(1000)).unwrap();
+        credits.wait_for_first_report();
+        reader
+    });
+
+    let frame_time = Duration::from_secs_f64(1.0 / options.framerate.max(1) as f64);
+    let mut frame = options.start_frame;
+    let mut count: u64 = 0;
+    let start = Instant::now();
+    let mut last_report = start;
+    loop {
+        if frame >= container.frame_count() {
+            if !options.looping || container.frame_count() == 0 {
+                break;
+            }
+            frame = 0;
+        }
+
+        // frames are due on a fixed schedule, so a slow write doesn't
+        // push every frame after it back
+        let due = start + frame_time * count as u32;
+        if let Some(wait) = due.checked_duration_since(Instant::now()) {
+            thread::sleep(wait);
+        }
+
+        if let Some(ref sharpie) = sharpie {
+            if credits.can_send() {
+                credits.sent_frame();
+                sharpie.write(container.frame(frame), Duration::from_millis(1000)).unwrap();
+            } else {
+                credits.dropped_frame();
+            }
+        }
+
+        frame += 1;
+        count += 1;
+        if count % REPORT_INTERVAL == 0 {
+            let elapsed = last_report.elapsed();
+            last_report = Instant::now();
+            println!("at frame {} of {}, last {} frames in {:.2} s ({:.1} fps), {} dropped",
+                     frame, container.frame_count(), REPORT_INTERVAL, elapsed.as_secs_f64(),
+                     REPORT_INTERVAL as f64 / elapsed.as_secs_f64(), credits.dropped());
+        }
+    }
+
+    credits.stop();
+    if let Some(reader) = reader {
+        let _ = reader.join();
+    }
+}
@@ -0,0 +1,100 @@
+// What goes over USB. Every message starts with a fixed-size header:
+//
+//   u32 payload size (the bytes after the header)
+//   u16 payload type (see PayloadType)
+//   u16 number of row ranges (0 for a full frame, see partial.rs)
+//   MAX_RANGES x (u16 first row, u16 row count)
+//
+// all little-endian. This has to match frame_header_t in the client.
+
+use crate::partial::{RowRange, MAX_RANGES};
+
+pub const HEADER_SIZE: usize = 4 + 2 + 2 + MAX_RANGES * 4;
+
+/// The biggest dictionary the client has room for. This has to match
+/// MAX_DICTIONARY_SIZE in the client.
+pub const MAX_DICTIONARY_SIZE: usize = 16 * 1024;
+
+/// The biggest zstd window the client decompresses frames with (as a
+/// power of two). It decompresses a few rows at a time, and zstd keeps
+/// a window's worth of what came before, so the client can't spare
+/// much. This has to match MAX_WINDOW_LOG in the client.
+pub const MAX_WINDOW_LOG: u32 = 13;
+
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum PayloadType {
+    /// zstd data for a full or partial frame
+    Frame = 0,
+    /// a raw zstd dictionary that every frame after it is compressed
+    /// with
+    Dictionary = 1,
+    /// zstd data for a full or partial frame that's been XORed with
+    /// what's on the display (see delta.rs)
+    DeltaFrame = 2,
+}
+
+impl PayloadType {
+    fn from_u16(value: u16) -> Option<PayloadType> {
+        match value {
+            0 => Some(PayloadType::Frame),
+            1 => Some(PayloadType::Dictionary),
+            2 => Some(PayloadType::DeltaFrame),
+            _ => None,
+        }
+    }
+}
+
+/// A header read back off the wire.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Header {
+    /// None if the type is one we don't know about
+    pub payload_type: Option<PayloadType>,
+    pub payload_size: usize,
+    /// every range the header claims to have, which can be more than
+    /// MAX_RANGES if it's garbage
+    pub range_count: usize,
+    pub ranges: Vec<RowRange>,
+}
+
+/// Read a header made by `header`, the way the client does.
+pub fn parse_header(header: &[u8; HEADER_SIZE]) -> Header {
+    let u16_at = |i: usize| u16::from_le_bytes([header[i], header[i + 1]]);
+    let range_count = u16_at(6) as usize;
+    let ranges = header[8..].chunks_exact(4)
+        .take(range_count)
+        .map(|slot| RowRange {
+            first: u16::from_le_bytes([slot[0], slot[1]]) as usize,
+            count: u16::from_le_bytes([slot[2], slot[3]]) as usize,
+        })
+        .collect();
+    Header {
+        payload_type: PayloadType::from_u16(u16_at(4)),
+        payload_size: u32::from_le_bytes(header[0..4].try_into().unwrap()) as usize,
+        range_count,
+        ranges,
+    }
+}
+
+/// The header for a message with `payload_size` bytes after it.
+/// `ranges` is empty for anything but a partial frame.
+pub fn header(payload_type: PayloadType, payload_size: usize,
+              ranges: &[RowRange]) -> [u8; HEADER_SIZE] {
+    assert!(ranges.len() <= MAX_RANGES);
+    let mut header = [0u8; HEADER_SIZE];
+    header[0..4].copy_from_slice(&u32::to_le_bytes(payload_size as u32));
+    header[4..6].copy_from_slice(&u16::to_le_bytes(payload_type as u16));
+    header[6..8].copy_from_slice(&u16::to_le_bytes(ranges.len() as u16));
+    for (slot, range) in header[8..].chunks_exact_mut(4).zip(ranges) {
+        slot[0..2].copy_from_slice(&u16::to_le_bytes(range.first as u16));
+        slot[2..4].copy_from_slice(&u16::to_le_bytes(range.count as u16));
+    }
+    header
+}
+
+/// A whole dictionary message, ready to send.
+pub fn dictionary_message(dictionary: &[u8]) -> Vec<u8> {
+    assert!(dictionary.len() <= MAX_DICTIONARY_SIZE);
+    let mut message = header(PayloadType::Dictionary, dictionary.len(), &[]).to_vec();
+    message.extend_from_slice(dictionary);
+    message
+}
@@ -0,0 +1,228 @@
+// Picks the zstd level for every frame. Level 6 is a good middle
+// ground on average, but a busy frame (lots of motion, or a scene
+// full of fine detail) can come out bigger than full-speed USB can
+// move in one frame time, and the frame after it shows up late. A
+// quiet frame, on the other hand, fits with room to spare at level 1,
+// and anything higher is just burning CPU.
+//
+// So the controller keeps a smoothed compressed size and compression
+// time, and after every frame moves the level one step:
+//
+// - down, if compressing is eating too much of the frame time, or if
+//   Sharpie's decoder is what's holding things up (then fewer bytes
+//   don't help, and neither does the extra CPU)
+// - up, if frames are coming out over the byte budget
+// - down, if they're well under it
+//
+// with a gap between "over" and "well under", and a few frames after
+// every change before it'll go back down, so it doesn't flip back and
+// forth. Going up never waits, since that's what keeps busy frames on
+// time. Higher levels also change zstd's match finder and strategy,
+// so the level is the only knob this needs.
+//
+// This is also where `--framerate auto` picks a framerate: it starts
+// at the fastest Sharpie can go, watches how many frames actually make
+// it through for a few seconds, and settles a bit below that.
+
+use std::str::FromStr;
+use std::time::{Duration, Instant};
+
+/// About how many bytes a second actually make it over full-speed USB
+/// to Sharpie. The theoretical bulk limit is ~1.2 MB/s, but we top
+/// out a bit below that.
+pub const LINK_BYTES_PER_SEC: usize = 1_000_000;
+
+const MIN_LEVEL: i32 = 1;
+/// Past this, zstd gets too slow to keep up with video for very
+/// little gain (see the zstd benchmarks).
+const MAX_LEVEL: i32 = 12;
+pub const DEFAULT_LEVEL: i32 = 6;
+
+/// Aim for frames this much of the budget, so a busy frame has some
+/// room before it's actually late.
+const TARGET_SHARE: f64 = 0.8;
+/// Frames smaller than this much of the budget are cheap enough that
+/// we can spend less CPU on them.
+const EASY_SHARE: f64 = 0.5;
+/// Compression shouldn't take more than this much of a frame time, so
+/// the compress stage never becomes the bottleneck.
+const CPU_SHARE: f64 = 0.5;
+
+/// How much each new frame moves the averages.
+const SMOOTHING: f64 = 0.25;
+/// Frames to wait after changing the level before lowering it, so the
+/// averages can catch up.
+const HOLD_FRAMES: u32 = 4;
+
+/// Sharpie can't go faster than this (see the README).
+pub const MAX_FRAMERATE: u32 = 21;
+
+/// Auto mode ignores the first frames this long, while the pipeline
+/// and the USB link get going.
+const AUTO_SETTLE: Duration = Duration::from_secs(1);
+/// Then it watches for this long before picking a framerate.
+const AUTO_WARMUP: Duration = Duration::from_secs(3);
+
+/// What `--framerate` asked for.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum Framerate {
+    Fixed(u32),
+    /// the highest rate the link and Sharpie can keep up with
+    Auto,
+}
+
+impl Framerate {
+    /// The framerate to start with.
+    pub fn initial(&self) -> u32 {
+        match *self {
+            Framerate::Fixed(framerate) => framerate,
+            Framerate::Auto => MAX_FRAMERATE,
+        }
+    }
+}
+
+impl FromStr for Framerate {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Framerate, String> {
+        if s == "auto" {
+            return Ok(Framerate::Auto);
+        }
+        match s.parse::<u32>() {
+            Ok(framerate) if framerate > 0 => Ok(Framerate::Fixed(framerate)),
+            _ => Err(format!("expected a framerate or \"auto\", got {:?}", s)),
+        }
+    }
+}
+
+/// Works out the framerate for `--framerate auto`. While the video
+/// runs at MAX_FRAMERATE, this counts frames coming out of the
+/// pipeline and frames the encoder dropped (because the queue or
+/// Sharpie was full). If nothing got dropped, MAX_FRAMERATE it is, and
+/// otherwise it comes down by the share that did.
+pub struct AutoFramerate {
+    first_frame: Option<Instant>,
+    /// when the measurement started, and how many frames had been
+    /// dropped by then
+    window_start: Option<(Instant, u64)>,
+    frames: u64,
+    done: bool,
+}
+
+impl AutoFramerate {
+    pub fn new() -> AutoFramerate {
+        AutoFramerate { first_frame: None, window_start: None, frames: 0, done: false }
+    }
+
+    /// Count a frame from the pipeline. `dropped` is how many frames
+    /// the encoder has dropped so far. Once the warmup is over, this
+    /// returns the framerate to switch to, and after that it does
+    /// nothing.
+    pub fn frame(&mut self, dropped: u64) -> Option<u32> {
+        if self.done {
+            return None;
+        }
+        let now = Instant::now();
+        let first_frame = *self.first_frame.get_or_insert(now);
+        if now - first_frame < AUTO_SETTLE {
+            return None;
+        }
+        let (start, start_dropped) = *self.window_start.get_or_insert((now, dropped));
+        self.frames += 1;
+        let elapsed = now - start;
+        if elapsed < AUTO_WARMUP {
+            return None;
+        }
+
+        self.done = true;
+        let dropped = dropped - start_dropped;
+        if dropped == 0 {
+            return Some(MAX_FRAMERATE);
+        }
+        // going by the share of frames that made it, rather than frames
+        // per second, so a pipeline that's a little late now and then
+        // doesn't count as dropping
+        let delivered = self.frames.saturating_sub(dropped);
+        let sustainable = MAX_FRAMERATE as f64 * delivered as f64 / self.frames as f64;
+        Some((sustainable as u32).clamp(1, MAX_FRAMERATE))
+    }
+}
+
+pub struct RateController {
+    /// bytes per frame the link can take at the target framerate
+    budget: f64,
+    frame_time: f64,
+    level: i32,
+    average_size: f64,
+    /// in seconds
+    average_time: f64,
+    hold: u32,
+}
+
+impl RateController {
+    pub fn new(framerate: u32) -> RateController {
+        let mut controller = RateController {
+            budget: 0.0,
+            frame_time: 0.0,
+            level: DEFAULT_LEVEL,
+            average_size: 0.0,
+            average_time: 0.0,
+            hold: 0,
+        };
+        controller.set_framerate(framerate);
+        controller
+    }
+
+    pub fn level(&self) -> i32 {
+        self.level
+    }
+
+    /// Change the framerate we're aiming for, which changes the byte
+    /// budget.
+    pub fn set_framerate(&mut self, framerate: u32) {
+        let framerate = framerate.max(1) as f64;
+        self.budget = LINK_BYTES_PER_SEC as f64 / framerate;
+        self.frame_time = 1.0 / framerate;
+    }
+
+    /// Tell the controller how the last frame went: what it compressed
+    /// to, how long compressing took, and how long Sharpie last said
+    /// decoding took (if it's sending status reports). Returns the
+    /// level for the next frame.
+    pub fn update(&mut self, size: usize, compress_time: Duration,
+                  device_decode_time: Option<Duration>) -> i32 {
+        if self.average_size == 0.0 {
+            self.average_size = size as f64;
+            self.average_time = compress_time.as_secs_f64();
+        } else {
+            self.average_size += (size as f64 - self.average_size) * SMOOTHING;
+            self.average_time += (compress_time.as_secs_f64() - self.average_time) * SMOOTHING;
+        }
+        self.hold = self.hold.saturating_sub(1);
+
+        let too_slow = self.average_time > self.frame_time * CPU_SHARE;
+        let device_bound = device_decode_time
+            .is_some_and(|decode| decode.as_secs_f64() > self.frame_time);
+        let too_big = self.average_size > self.budget * TARGET_SHARE;
+        let easy = self.average_size < self.budget * EASY_SHARE;
+
+        let level = if too_slow || (device_bound && !too_big) {
+            self.level - 1
+        } else if too_big {
+            self.level + 1
+        } else if easy {
+            self.level - 1
+        } else {
+            self.level
+        }.clamp(MIN_LEVEL, MAX_LEVEL);
+
+        if level < self.level && self.hold > 0 {
+            return self.level;
+        }
+        if level != self.level {
+            self.level = level;
+            self.hold = HOLD_FRAMES;
+        }
+        self.level
+    }
+}
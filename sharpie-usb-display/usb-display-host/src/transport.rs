@@ -0,0 +1,44 @@
+// How frames get to Sharpie. Normally that's the vendor interface of
+// a real Sharpie over USB (written to asynchronously, see
+// async_usb.rs), but the encoder only needs to write messages and
+// read status reports, so anything that can do that can stand in for
+// it (see loopback.rs).
+
+use std::time::Duration;
+
+use rusb;
+
+// remember: USB endpoint names are relative to the host
+pub const SHARPIE_EP_OUT: u8 = 0x01;
+pub const SHARPIE_EP_IN: u8 = 0x81;
+
+/// Something that takes messages (see protocol.rs) and sends back
+/// status reports (see credits.rs). Errors are rusb's, so a timeout
+/// looks the same no matter what's on the other end.
+pub trait Transport: Send + Sync {
+    /// Send `data`, blocking until it's all gone or `timeout` runs
+    /// out.
+    fn write(&self, data: &[u8], timeout: Duration) -> rusb::Result<usize>;
+
+    /// Wait up to `timeout` for a status report, and read it into
+    /// `buf`.
+    fn read(&self, buf: &mut [u8], timeout: Duration) -> rusb::Result<usize>;
+
+    /// For transports whose writes return before the data's actually
+    /// gone: how long each write that's finished since the last call
+    /// took to go out. None means writes block until they're sent, so
+    /// timing `write` itself says the same thing.
+    fn take_write_times(&self) -> Option<Vec<Duration>> {
+        None
+    }
+}
+
+impl Transport for rusb::DeviceHandle<rusb::GlobalContext> {
+    fn write(&self, data: &[u8], timeout: Duration) -> rusb::Result<usize> {
+        self.write_bulk(SHARPIE_EP_OUT, data, timeout)
+    }
+
+    fn read(&self, buf: &mut [u8], timeout: Duration) -> rusb::Result<usize> {
+        self.read_bulk(SHARPIE_EP_IN, buf, timeout)
+    }
+}